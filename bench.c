@@ -0,0 +1,771 @@
+/*	$OpenBSD$	*/
+/*
+ * Copyright (c) 2014-2021 Alexandre Ratchov <alex@caoua.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Micro-benchmarks of the control tracking and key dispatch code.
+ *
+ * sndiokeys.c is included with the sioctl and X functions it calls
+ * replaced by stubs and with allocations counted, so neither an X
+ * server nor sndiod is needed. Controls and key presses are synthetic,
+ * or replayed from a trace recorded with sndiokeys -w.
+ */
+#include <X11/Xlib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Synthetic device: NNODE nodes with a level and a mute control, and
+ * NSEL selectors with NENT entries each
+ */
+#define NNODE		64
+#define NSEL		32
+#define NENT		8
+#define NDESC		(2 * NNODE + NSEL * NENT)
+
+/*
+ * Number of iterations of each benchmark
+ */
+#define NLOAD		200
+#define NITER		200000
+
+static unsigned long bench_nalloc;
+
+static void *
+bench_malloc(size_t size)
+{
+	bench_nalloc++;
+	return malloc(size);
+}
+
+static void *
+bench_reallocarray(void *ptr, size_t nmemb, size_t size)
+{
+	bench_nalloc++;
+	return reallocarray(ptr, nmemb, size);
+}
+
+/*
+ * keymap of the fake X server, replaced by the trace
+ */
+KeySym *bench_xmap;
+int bench_xmin, bench_xmax, bench_xwidth;
+unsigned int bench_ngrabs;
+
+#ifndef USE_XCB
+#undef ScreenCount
+#undef RootWindow
+#undef NextRequest
+#define ScreenCount(dpy)	1
+#define RootWindow(dpy, scr)	0
+#define NextRequest(dpy)	0
+
+static int
+bench_XGrabKey(Display *dpy, int code, unsigned int mods, Window win,
+    Bool owner, int pmode, int kmode)
+{
+	bench_ngrabs++;
+	return 0;
+}
+
+static int
+bench_XUngrabKey(Display *dpy, int code, unsigned int mods, Window win)
+{
+	return 0;
+}
+
+static int
+bench_XSync(Display *dpy, Bool discard)
+{
+	return 0;
+}
+
+static int
+bench_XDisplayKeycodes(Display *dpy, int *min, int *max)
+{
+	*min = bench_xmin;
+	*max = bench_xmax;
+	return 0;
+}
+
+static KeySym *
+bench_XGetKeyboardMapping(Display *dpy, KeyCode first, int count,
+    int *width)
+{
+	KeySym *map;
+	size_t n;
+
+	n = (size_t)count * bench_xwidth;
+	map = malloc(n * sizeof(KeySym));
+	if (map == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	memcpy(map, bench_xmap, n * sizeof(KeySym));
+	*width = bench_xwidth;
+	return map;
+}
+
+static XModifierKeymap *
+bench_XGetModifierMapping(Display *dpy)
+{
+	return NULL;
+}
+
+static KeyCode
+bench_XKeysymToKeycode(Display *dpy, KeySym sym)
+{
+	int i, n;
+
+	n = (bench_xmax - bench_xmin + 1) * bench_xwidth;
+	for (i = 0; i < n; i++) {
+		if (bench_xmap[i] == sym)
+			return bench_xmin + i / bench_xwidth;
+	}
+	return 0;
+}
+
+static int
+bench_XFree(void *ptr)
+{
+	free(ptr);
+	return 0;
+}
+
+#define XGrabKey		bench_XGrabKey
+#define XUngrabKey		bench_XUngrabKey
+#define XSync			bench_XSync
+#define XDisplayKeycodes	bench_XDisplayKeycodes
+#define XGetKeyboardMapping	bench_XGetKeyboardMapping
+#define XGetModifierMapping	bench_XGetModifierMapping
+#define XKeysymToKeycode	bench_XKeysymToKeycode
+#define XFree			bench_XFree
+#endif
+
+#define malloc		bench_malloc
+#define reallocarray	bench_reallocarray
+#define sioctl_open	bench_open
+#define sioctl_ondesc	bench_ondesc
+#define sioctl_onval	bench_onval
+#define sioctl_nfds	bench_nfds
+#define sioctl_setval	bench_setval
+#define sioctl_close	bench_close
+#define main		sndiokeys_main
+
+#include "sndiokeys.c"
+
+#undef malloc
+#undef reallocarray
+#undef main
+
+struct sioctl_desc bench_desc[NDESC];
+unsigned int bench_nsetval;
+
+/*
+ * devices of the trace, by number, and time spent per record type
+ */
+struct dev *bench_devs[256];
+struct bench_stat {
+	unsigned long count;
+	long long nsec;
+} bench_stats[TRACE_NTYPES];
+char *bench_names[TRACE_NTYPES] = {
+	"header", "dev", "keys", "mapping", "press", "release",
+	"open", "close", "desc", "descend", "val", "flush"
+};
+
+/*
+ * the trace contains the dump, so there's nothing to call back; it
+ * is replayed by calling ondesc() and onval() directly
+ */
+struct sioctl_hdl *
+bench_open(const char *name, unsigned int mode, int nbio)
+{
+	return (struct sioctl_hdl *)bench_devs;
+}
+
+int
+bench_ondesc(struct sioctl_hdl *hdl,
+    void (*cb)(void *, struct sioctl_desc *, int), void *arg)
+{
+	return 1;
+}
+
+int
+bench_onval(struct sioctl_hdl *hdl,
+    void (*cb)(void *, unsigned int, unsigned int), void *arg)
+{
+	return 1;
+}
+
+int
+bench_nfds(struct sioctl_hdl *hdl)
+{
+	return 0;
+}
+
+int
+bench_setval(struct sioctl_hdl *hdl, unsigned int addr, unsigned int val)
+{
+	bench_nsetval++;
+	return 1;
+}
+
+void
+bench_close(struct sioctl_hdl *hdl)
+{
+}
+
+static long long
+nstime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+bench_report(char *name, long long start, unsigned long nalloc, long nops)
+{
+	printf("%-12s %10.1f ns/op %8.2f allocs/op\n", name,
+	    (double)(nstime() - start) / nops,
+	    (double)(bench_nalloc - nalloc) / nops);
+}
+
+/*
+ * build the descriptors, in a scrambled order as sndiod doesn't
+ * send them sorted
+ */
+static void
+bench_mkdesc(void)
+{
+	struct sioctl_desc *d, tmp;
+	unsigned int seed;
+	int i, j, n;
+
+	n = 0;
+	for (i = 0; i < NNODE; i++) {
+		d = &bench_desc[n++];
+		memset(d, 0, sizeof(*d));
+		d->type = SIOCTL_NUM;
+		snprintf(d->node0.name, SIOCTL_NAMEMAX, "node%d", i);
+		d->node0.unit = -1;
+		snprintf(d->func, SIOCTL_NAMEMAX, "level");
+		d->maxval = 127;
+
+		d = &bench_desc[n++];
+		memset(d, 0, sizeof(*d));
+		d->type = SIOCTL_SW;
+		snprintf(d->node0.name, SIOCTL_NAMEMAX, "node%d", i);
+		d->node0.unit = -1;
+		snprintf(d->func, SIOCTL_NAMEMAX, "mute");
+		d->maxval = 1;
+	}
+	for (i = 0; i < NSEL; i++) {
+		for (j = 0; j < NENT; j++) {
+			d = &bench_desc[n++];
+			memset(d, 0, sizeof(*d));
+			d->type = SIOCTL_SEL;
+			snprintf(d->node0.name, SIOCTL_NAMEMAX, "sel%d", i);
+			d->node0.unit = -1;
+			snprintf(d->func, SIOCTL_NAMEMAX, "device");
+			snprintf(d->node1.name, SIOCTL_NAMEMAX, "ent%d", j);
+			d->node1.unit = -1;
+			d->maxval = 1;
+		}
+	}
+
+	seed = 1;
+	for (i = NDESC - 1; i > 0; i--) {
+		seed = seed * 1103515245 + 12345;
+		j = (seed >> 16) % (i + 1);
+		tmp = bench_desc[i];
+		bench_desc[i] = bench_desc[j];
+		bench_desc[j] = tmp;
+	}
+	for (i = 0; i < NDESC; i++)
+		bench_desc[i].addr = i;
+}
+
+/*
+ * bind a key to each node and selector, with one keycode per key
+ */
+static void
+bench_mkkeys(struct dev *d)
+{
+	char name[SIOCTL_NAMEMAX];
+	struct key *key;
+	KeyCode code;
+	int i;
+
+	keymap_min = 8;
+	keymap_max = 255;
+	keymap_width = 2;
+	keymap = calloc((keymap_max - keymap_min + 1) * keymap_width,
+	    sizeof(KeySym));
+	if (keymap == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+
+	code = keymap_min;
+	for (i = 0; i < NNODE; i++) {
+		snprintf(name, sizeof(name), "node%d", i);
+		key = add_key(ControlMask, 0x1000 + code, d, name, "level",
+		    i & 1 ? 1 : -1);
+		key->code = code++;
+	}
+	for (i = 0; i < NSEL; i++) {
+		snprintf(name, sizeof(name), "sel%d", i);
+		key = add_key(ControlMask, 0x1000 + code, d, name, "device", 0);
+		key->code = code++;
+	}
+	for (key = key_list; key != NULL; key = key->next)
+		keymap[(key->code - keymap_min) * keymap_width] = key->sym;
+	keymap_link();
+}
+
+static void
+bench_load(struct dev *d)
+{
+	int i;
+
+	for (i = 0; i < NDESC; i++)
+		ondesc(d, &bench_desc[i], bench_desc[i].type == SIOCTL_SEL ?
+		    bench_desc[i].node1.name[3] == '0' : 0);
+	ondesc(d, NULL, 0);
+}
+
+static void
+bench_badtrace(char *path)
+{
+	fprintf(stderr, "%s: bad or truncated trace\n", path);
+	exit(1);
+}
+
+static uint32_t
+bench_get32(char **p, char *end, char *path)
+{
+	uint32_t val;
+
+	if (end - *p < sizeof(uint32_t))
+		bench_badtrace(path);
+	memcpy(&val, *p, sizeof(uint32_t));
+	*p += sizeof(uint32_t);
+	return val;
+}
+
+static char *
+bench_getstr(char **p, char *end, char *path)
+{
+	char *str, *nul;
+
+	nul = memchr(*p, 0, end - *p);
+	if (nul == NULL)
+		bench_badtrace(path);
+	str = *p;
+	*p = nul + 1;
+	return str;
+}
+
+/*
+ * read a keymap and make it the one of the fake X server
+ */
+static void
+bench_getkeymap(char **p, char *end, char *path)
+{
+	int i, n;
+
+	bench_xmin = bench_get32(p, end, path);
+	bench_xmax = bench_get32(p, end, path);
+	bench_xwidth = bench_get32(p, end, path);
+	if (bench_xmin < 0 || bench_xmax > 255 || bench_xmin > bench_xmax ||
+	    bench_xwidth <= ShiftMask || bench_xwidth > 256)
+		bench_badtrace(path);
+	n = (bench_xmax - bench_xmin + 1) * bench_xwidth;
+	free(bench_xmap);
+	bench_xmap = malloc(n * sizeof(KeySym));
+	if (bench_xmap == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	for (i = 0; i < n; i++)
+		bench_xmap[i] = bench_get32(p, end, path);
+}
+
+static struct dev *
+bench_getdev(int id, char *path)
+{
+	if (bench_devs[id] == NULL)
+		bench_badtrace(path);
+	return bench_devs[id];
+}
+
+/*
+ * replace the bindings and the keymap by the ones of the trace, as
+ * if all the keys were grabbed again
+ */
+static void
+bench_setkeys(char *p, char *end, int nkeys, char *path)
+{
+	struct key *key;
+	struct dev *d;
+	unsigned int modmask, code;
+	KeySym sym;
+	char *name, *func;
+	int n, dir;
+
+	/*
+	 * free the keymap first, so key_del() doesn't ungrab keys,
+	 * which the XCB backend would try to do with no server
+	 */
+	bench_getkeymap(&p, end, path);
+	keymap_free();
+	while ((key = key_list) != NULL) {
+		key_list = key->next;
+		key_del(key);
+	}
+	n = (bench_xmax - bench_xmin + 1) * bench_xwidth;
+	keymap = malloc(n * sizeof(KeySym));
+	if (keymap == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	memcpy(keymap, bench_xmap, n * sizeof(KeySym));
+	keymap_min = bench_xmin;
+	keymap_max = bench_xmax;
+	keymap_width = bench_xwidth;
+
+	for (n = 0; n < nkeys; n++) {
+		modmask = bench_get32(&p, end, path);
+		sym = bench_get32(&p, end, path);
+		code = bench_get32(&p, end, path);
+		dir = (int32_t)bench_get32(&p, end, path);
+		d = bench_getdev(bench_get32(&p, end, path) & 0xff, path);
+		name = bench_getstr(&p, end, path);
+		func = bench_getstr(&p, end, path);
+		if (code < keymap_min || code > keymap_max)
+			bench_badtrace(path);
+		key = add_key(modmask, sym, d, name, func, dir);
+		key->code = code;
+	}
+	keymap_link();
+	for (key = key_list; key != NULL; key = key->next) {
+		if (key->dev->ctl_hdl && !key->dev->ctl_loading)
+			key_resolve(key);
+	}
+}
+
+static void
+bench_getdesc(struct sioctl_desc *desc, char *p, char *end, char *path)
+{
+	memset(desc, 0, sizeof(struct sioctl_desc));
+	desc->type = bench_get32(&p, end, path);
+	desc->maxval = bench_get32(&p, end, path);
+	desc->node0.unit = (int32_t)bench_get32(&p, end, path);
+	desc->node1.unit = (int32_t)bench_get32(&p, end, path);
+	snprintf(desc->group, SIOCTL_NAMEMAX, "%s",
+	    bench_getstr(&p, end, path));
+	snprintf(desc->node0.name, SIOCTL_NAMEMAX, "%s",
+	    bench_getstr(&p, end, path));
+	snprintf(desc->func, SIOCTL_NAMEMAX, "%s",
+	    bench_getstr(&p, end, path));
+	snprintf(desc->node1.name, SIOCTL_NAMEMAX, "%s",
+	    bench_getstr(&p, end, path));
+}
+
+/*
+ * load the whole trace, so reading it is not measured
+ */
+static char *
+bench_readtrace(char *path, size_t *rsize)
+{
+	FILE *f;
+	char *buf, *p;
+	size_t size, used, n;
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		perror(path);
+		exit(1);
+	}
+	buf = NULL;
+	size = used = 0;
+	do {
+		if (used == size) {
+			size = size ? 2 * size : 65536;
+			p = realloc(buf, size);
+			if (p == NULL) {
+				perror("realloc");
+				exit(1);
+			}
+			buf = p;
+		}
+		n = fread(buf + used, 1, size - used, f);
+		used += n;
+	} while (n > 0);
+	if (ferror(f)) {
+		perror(path);
+		exit(1);
+	}
+	fclose(f);
+	*rsize = used;
+	return buf;
+}
+
+/*
+ * push the records of the trace through the same code as the main
+ * loop. If pace is set, the recorded delays between records are
+ * respected, so rate limits and ramps behave as when recorded
+ */
+static void
+bench_replay(char *path, int pace)
+{
+	struct trace_rec r;
+	struct sioctl_desc desc;
+	struct bench_stat *st;
+	struct timespec ts;
+	struct dev *d;
+	char *buf, *p, *data, *end;
+	long long start, due, delay;
+	size_t size;
+	int i;
+
+	buf = bench_readtrace(path, &size);
+	p = buf;
+	end = buf + size;
+	if (end - p < sizeof(struct trace_rec))
+		bench_badtrace(path);
+	memcpy(&r, p, sizeof(struct trace_rec));
+	p += sizeof(struct trace_rec);
+	if (r.type != TRACE_HEADER || r.a != TRACE_MAGIC ||
+	    r.b != TRACE_VERSION || r.len > end - p) {
+		fprintf(stderr, "%s: not a trace\n", path);
+		exit(1);
+	}
+	data = p;
+	p += r.len;
+	step_accel = bench_get32(&data, p, path);
+	step_log = bench_get32(&data, p, path);
+	ctl_rate = bench_get32(&data, p, path);
+	ramp_rate = bench_get32(&data, p, path);
+
+	due = nstime();
+	while (p != end) {
+		if (end - p < sizeof(struct trace_rec))
+			bench_badtrace(path);
+		memcpy(&r, p, sizeof(struct trace_rec));
+		p += sizeof(struct trace_rec);
+		if (r.len > end - p)
+			bench_badtrace(path);
+		data = p;
+		p += r.len;
+
+		if (pace) {
+			due += r.time * 1000LL;
+			delay = due - nstime();
+			if (delay > 0) {
+				ts.tv_sec = delay / 1000000000;
+				ts.tv_nsec = delay % 1000000000;
+				nanosleep(&ts, NULL);
+			}
+		}
+
+		start = nstime();
+		switch (r.type) {
+		case TRACE_DEV:
+			bench_devs[r.arg] = dev_get(bench_getstr(&data, p, path));
+			break;
+		case TRACE_KEYS:
+			bench_setkeys(data, p, r.a, path);
+			break;
+		case TRACE_MAPPING:
+#ifdef USE_XCB
+			fprintf(stderr, "%s: can't replay keyboard mapping "
+			    "changes with XCB\n", path);
+			exit(1);
+#else
+			if (r.arg == MappingModifier ||
+			    r.arg == MappingKeyboard)
+				bench_getkeymap(&data, p, path);
+			x_mapping(r.arg);
+			break;
+#endif
+		case TRACE_PRESS:
+			x_keypress(r.arg, r.a, r.b);
+			break;
+		case TRACE_RELEASE:
+			x_keyrelease(r.arg);
+			break;
+		case TRACE_OPEN:
+			d = bench_getdev(r.arg, path);
+			if (d->ctl_hdl == NULL)
+				ctl_open(d);
+			break;
+		case TRACE_CLOSE:
+			d = bench_getdev(r.arg, path);
+			if (d->ctl_hdl)
+				ctl_close(d);
+			break;
+		case TRACE_DESC:
+			bench_getdesc(&desc, data, p, path);
+			desc.addr = r.a;
+			ondesc(bench_getdev(r.arg, path), &desc, r.b);
+			break;
+		case TRACE_DESCEND:
+			ondesc(bench_getdev(r.arg, path), NULL, 0);
+			break;
+		case TRACE_VAL:
+			onval(bench_getdev(r.arg, path), r.a, r.b);
+			break;
+		case TRACE_FLUSH:
+			/* same as after each batch of events in main() */
+			if (ramp_count > 0)
+				ramp_run();
+			for (d = dev_list; d != NULL; d = d->next) {
+				if (d->ctl_hdl)
+					ctl_flush(d);
+			}
+			break;
+		default:
+			bench_badtrace(path);
+		}
+
+		st = &bench_stats[r.type];
+		st->count++;
+		st->nsec += nstime() - start;
+	}
+	free(buf);
+
+	for (i = 0; i < TRACE_NTYPES; i++) {
+		st = &bench_stats[i];
+		if (st->count == 0)
+			continue;
+		printf("%-12s %10.1f ns/op %8lu records\n", bench_names[i],
+		    (double)st->nsec / st->count, st->count);
+	}
+	printf("%u setvals, %u grabs\n", bench_nsetval, bench_ngrabs);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct dev *d;
+	struct ctl *i, *j;
+	struct key *key;
+	unsigned long nalloc;
+	long long start;
+	long n, count;
+	int c, pace;
+
+	atom_empty = atom("");
+	silent = 1;
+
+	pace = 0;
+	while ((c = getopt(argc, argv, "pt")) != -1) {
+		switch (c) {
+		case 'p':
+			pace = 1;
+			break;
+		case 't':
+			timing = 1;
+			break;
+		default:
+			goto bad_usage;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc > 1) {
+	bad_usage:
+		fputs("usage: bench [-pt] [trace]\n", stderr);
+		return 1;
+	}
+	if (argc == 1) {
+		bench_replay(argv[0], pace);
+		if (timing)
+			timing_dump();
+		log_flush(0);
+		return 0;
+	}
+
+	d = dev_get("bench");
+	dev_default = d;
+	d->ctl_hdl = (struct sioctl_hdl *)d;
+
+	bench_mkdesc();
+	bench_mkkeys(d);
+
+	nalloc = bench_nalloc;
+	start = nstime();
+	for (n = 0; n < NLOAD; n++) {
+		ctl_clear(d);
+		d->ctl_hdl = (struct sioctl_hdl *)d;
+		d->ctl_loading = 1;
+		bench_load(d);
+	}
+	bench_report("ondesc", start, nalloc, (long)NLOAD * NDESC);
+
+	nalloc = bench_nalloc;
+	start = nstime();
+	for (n = 0; n < NITER; n++)
+		onval(d, n % NDESC, n & 127);
+	bench_report("onval", start, nalloc, NITER);
+
+	nalloc = bench_nalloc;
+	start = nstime();
+	count = 0;
+	for (n = 0; n < NITER / 100; n++) {
+		for (i = d->ctl_list; i != NULL; i = nextctl(i)) {
+			count++;
+			if (i->type != SIOCTL_SEL)
+				continue;
+			for (j = i; j != NULL; j = nextent(j))
+				count++;
+		}
+	}
+	bench_report("nextctl", start, nalloc, count);
+
+	nalloc = bench_nalloc;
+	start = nstime();
+	count = 0;
+	for (n = 0; n < NITER / (NNODE + NSEL); n++) {
+		for (key = key_list; key != NULL; key = key->next) {
+			setval(key, n);
+			count++;
+		}
+		ctl_flush(d);
+	}
+	bench_report("setval", start, nalloc, count);
+
+	nalloc = bench_nalloc;
+	start = nstime();
+	for (n = 0; n < NITER; n++) {
+		x_keypress(keymap_min + n % (NNODE + NSEL + 16),
+		    n & 1 ? ControlMask : ControlMask | Mod2Mask, n);
+
+		/* flush once per round, as the main loop would */
+		if (n % (NNODE + NSEL + 16) == 0)
+			ctl_flush(d);
+	}
+	bench_report("keypress", start, nalloc, NITER);
+
+	printf("%u setvals\n", bench_nsetval);
+	return 0;
+}
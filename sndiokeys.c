@@ -14,14 +14,23 @@
  * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
 #include <poll.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <errno.h>
+#include <limits.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <sndio.h>
 #include <X11/Xlib.h>
 #include <X11/Xproto.h>
@@ -29,6 +38,10 @@
 #include <X11/keysym.h>
 #include <X11/XF86keysym.h>
 #include <X11/XKBlib.h>
+#ifdef USE_XCB
+#include <X11/Xlib-xcb.h>
+#include <xcb/xcb.h>
+#endif
 
 /*
  * The mask of modifiers supported for key-bindings.
@@ -41,22 +54,130 @@
 #define NSTEP		20
 
 /*
- * Max fds we poll
+ * Ratio between consecutive logarithmic steps: 10^(-3/20), i.e. 3dB
  */
-#define MAXFDS		64
+#define STEP_RATIO	0.70794578
+
+/*
+ * Acceleration: if a key is pressed again within ACCEL_DELAY ms,
+ * the number of steps is doubled every ACCEL_COUNT presses, up to
+ * ACCEL_MAX steps per press
+ */
+#define ACCEL_DELAY	250
+#define ACCEL_COUNT	5
+#define ACCEL_MAX	4
+
+/*
+ * Number of buckets of the address-indexed control table, power of 2
+ */
+#define CTL_NHASH	256
+#define CTL_HASH(addr)	((addr) & (CTL_NHASH - 1))
+
+/*
+ * Number of controls per allocation block
+ */
+#define CTL_POOLSZ	64
+
+/*
+ * Number of buckets of the control name table, power of 2
+ */
+#define ATOM_NHASH	64
 
 /*
  * Keyboard bell parameters
  */
 #define BELL_RATE	48000
 #define BELL_LEN	(BELL_RATE / 20)
-#define BELL_PERIOD	(BELL_RATE / 880)
 #define BELL_AMP	(INT16_MAX / 32)
 
+/*
+ * Delay between attempts to reopen the bell device in hot mode (ms)
+ */
+#define BELL_RETRY	1000
+
+/*
+ * Min and max delays between attempts to reconnect to the control
+ * device in eager mode (ms), the delay doubles after each failure
+ */
+#define CTL_RETRY_MIN	250
+#define CTL_RETRY_MAX	8000
+
+/*
+ * Size of the beep request queue of the feedback thread, and max
+ * age of a request to be still worth playing (ms)
+ */
+#define BEEP_QUEUELEN	16
+#define BEEP_MAXAGE	500
+
+/*
+ * Tones played as feedback, one per kind of event
+ */
+#define TONE_BELL	0		/* X keyboard bell */
+#define TONE_UP		1		/* level increased */
+#define TONE_DOWN	2		/* level decreased */
+#define TONE_TOGGLE	3		/* switch toggled */
+#define TONE_SEL	4		/* selector moved to next entry */
+#define TONE_COUNT	5
+
+#define SHAPE_SQUARE	0
+#define SHAPE_TRIANGLE	1
+
+/*
+ * Log messages are stored in a ring and written to stderr from the
+ * main loop, when it's writable. At most LOG_RATE messages of each
+ * format are logged per second, the others are dropped.
+ */
+#define LOG_BUFSZ	8192
+#define LOG_LINEMAX	256
+#define LOG_RATE	20
+#define LOG_NRATE	32
+
+/*
+ * Configuration file used if -F is not given, relative to $HOME
+ */
+#define CONF_NAME	".sndiokeys"
+
+/*
+ * Max length of a command line received on the control socket
+ */
+#define CLIENT_BUFSZ	256
+
+/*
+ * Latencies measured in timing mode, in microseconds, and the
+ * number of power-of-two buckets of their histograms
+ */
+#define TIMING_KEY	0		/* key press to sioctl_setval() */
+#define TIMING_ECHO	1		/* sioctl_setval() to onval() */
+#define TIMING_BEEP	2		/* time spent in beep functions */
+#define TIMING_COUNT	3
+#define TIMING_NBUCKET	32
+
+/*
+ * Records of the event trace, -w option. Each one is a struct
+ * trace_rec followed by len bytes of payload, in host byte order:
+ * 32-bit integers and NUL-terminated strings
+ */
+#define TRACE_HEADER	0	/* a: magic, b: version; options */
+#define TRACE_DEV	1	/* arg: device number; name */
+#define TRACE_KEYS	2	/* a: number of keys; keymap, bindings */
+#define TRACE_MAPPING	3	/* arg: request; new keymap */
+#define TRACE_PRESS	4	/* arg: code, a: state, b: X time */
+#define TRACE_RELEASE	5	/* arg: code */
+#define TRACE_OPEN	6	/* arg: device number */
+#define TRACE_CLOSE	7	/* arg: device number */
+#define TRACE_DESC	8	/* arg: device, a: addr, b: val; desc */
+#define TRACE_DESCEND	9	/* arg: device number */
+#define TRACE_VAL	10	/* arg: device, a: addr, b: val */
+#define TRACE_FLUSH	11	/* main loop flushes the controls */
+#define TRACE_NTYPES	12
+
+#define TRACE_MAGIC	0x736b7472
+#define TRACE_VERSION	2
+
 #define logx(n, fmt, ...)						\
 	do {								\
 		if (verbose >= n)					\
-			fprintf(stderr, fmt "\n", ## __VA_ARGS__);	\
+			log_put(fmt "\n", ## __VA_ARGS__);		\
 	} while (0)
 
 struct modname {
@@ -69,641 +190,3913 @@ struct modname {
 	{0, NULL}
 };
 
+struct tone {
+	unsigned int freq;
+	int shape;
+} tone_tab[TONE_COUNT] = {
+	{880, SHAPE_SQUARE},		/* TONE_BELL */
+	{1175, SHAPE_TRIANGLE},		/* TONE_UP */
+	{659, SHAPE_TRIANGLE},		/* TONE_DOWN */
+	{880, SHAPE_TRIANGLE},		/* TONE_TOGGLE */
+	{1319, SHAPE_SQUARE},		/* TONE_SEL */
+};
+
+/*
+ * Interned control names: each distinct string is stored once
+ * and is identified by an integer, so names are compared with
+ * integer comparisons
+ */
+struct atom {
+	struct atom *next;
+	int id;
+	char name[1];
+} *atom_hash[ATOM_NHASH], **atom_tab;
+int atom_count, atom_size;
+int atom_empty;
+
 struct ctl {
-	struct ctl *next;
-	struct sioctl_desc desc;
+	struct ctl *next, *prev;	/* sorted list */
+	struct ctl *hash_next;		/* same CTL_HASH() bucket */
+	struct ctl *dirty_next;		/* next control to send */
+	unsigned int addr;
+	unsigned int maxval;
+	int type;
 	int val;
-} *ctl_list;
+	int dirty;			/* val not sent yet */
+	int group, node0, func, node1;	/* atoms of desc strings */
+	int unit0, unit1;		/* units of node0 and node1 */
+	long long send_time;		/* earliest time val may be sent */
+	struct dev *dev;		/* device the control belongs to */
+	long long key_time;		/* time of the key press, timing mode */
+	long long setval_time;		/* time val was sent, timing mode */
+};
+
+/*
+ * Controls are allocated in blocks, freed all at once when the
+ * device is closed
+ */
+struct ctl_pool {
+	struct ctl_pool *next;
+	struct ctl ctls[CTL_POOLSZ];
+};
+
+/*
+ * Audio device controlled
+ */
+struct dev {
+	struct dev *next;
+	char *name;
+	struct sioctl_hdl *ctl_hdl;
+	int ctl_maxfds;
+	int ctl_nfds;			/* fds used in the current poll() */
+	struct ctl *ctl_list, *ctl_hash[CTL_NHASH], *ctl_dirty;
+	int ctl_loading;		/* initial dump, ctl_list not sorted */
+	struct ctl_pool *ctl_pool;	/* blocks, first one is being filled */
+	int ctl_pool_used;		/* controls used in the first block */
+	struct ctl *ctl_free;		/* removed controls, for reuse */
+	struct ctl *ctl_stale;		/* snapshot replaced by the dump */
+	long long flush_time;		/* next ctl_flush() deadline, or 0 */
+	long long retry_time;		/* time of the next attempt to reconnect */
+	int retry_delay;
+	int trace_id;			/* number in the trace, 0 if none yet */
+	long long use_time;		/* last time controls were sent */
+} *dev_list, *dev_default;
 
 struct key {
 	struct key *next;
 	unsigned int modmask;
 	KeySym sym;
 	KeyCode code;
-	KeySym *map;
-	char *name;
-	char *func;
+	KeySym *map;			/* keysyms of the code, in keymap */
+	unsigned long grab_start;	/* serial of the first grab request */
+	unsigned long grab_end;		/* serial after the last one */
+	KeyCode newcode;		/* code after remapping */
+	struct dev *dev;		/* NULL for the default one */
+	int name;			/* atom */
+	int func;			/* atom */
+	int dir;
+	struct ctl **ctls;		/* first entry of each target */
+	int nctls, maxctls;
+	struct key *code_next;		/* next key with the same code */
+	Time last_time;			/* time of the last press */
+	int repeat;			/* number of presses in a row */
+	int ramping;			/* held down, in ramp mode */
+	long long ramp_time;		/* time of the next ramp step */
+	struct target *targets;		/* preset values, set at once */
+	int ntargets;
+	int conf;			/* comes from the config file */
+	int fresh;			/* added while running, not resolved */
+	int failed;			/* the grab failed */
+} *key_list, *key_tab[256];
+
+/*
+ * Value a preset key sets. Selectors are set to the entry named
+ * ent, other controls to val, in percent of maxval if pct is set
+ */
+struct target {
+	struct dev *dev;		/* NULL for the device of the key */
+	int name;			/* atom */
+	int func;			/* atom */
+	int ent;			/* atom of the value string */
+	int val;
+	int isnum;			/* value is a number */
+	int pct;
+};
+
+/*
+ * Binding of the configuration file. The table is sorted by control,
+ * so two versions of the file can be compared with a single pass.
+ */
+struct bind {
+	unsigned int modmask;
+	KeySym sym;
+	struct dev *dev;
+	int name;			/* atom */
+	int func;			/* atom */
 	int dir;
-} *key_list;
+	int line;			/* line number, only for sorting */
+} *conf_tab;
+int conf_count;
+char *cache_path;		/* snapshot of the controls, -C option */
+char *trace_path;		/* event trace, -w option */
+char *conf_path;
+int conf_required;		/* -F was used, the file must exist */
+volatile sig_atomic_t conf_reload_pending;
+int sig_fds[2] = {-1, -1};	/* self-pipe, to wake up poll() on signals */
+
+/*
+ * Logarithmic steps for the given maxval
+ */
+struct steptab {
+	struct steptab *next;
+	unsigned int maxval;
+	int val[NSTEP + 1];
+} *steptab_list;
 
 Display	*dpy;
 int (*error_handler_xlib)(Display *, XErrorEvent *);
-KeySym error_keysym;
+KeySym *keymap;
+int keymap_min, keymap_max, keymap_width;
+
+#ifdef USE_XCB
+/*
+ * Connection used for grabs and events, and the grabs waiting for
+ * their result
+ */
+xcb_connection_t *xcb;
+struct grab_req {
+	struct key *key;
+	xcb_void_cookie_t cookie;
+} *grab_reqs;
+int grab_nreqs, grab_maxreqs;
+#endif
+unsigned int keymap_mods;		/* modifiers bound to at least one key */
+int grab_nofatal;			/* don't exit on grab errors */
 
-char *dev_name;
+char *dev_name;			/* bell device */
 struct sio_hdl *beep_hdl;
 int beep_maxfds;
-struct sioctl_hdl *ctl_hdl;
-int ctl_maxfds;
-int maxfds;
+int beep_started;		/* sio_start() called */
+int beep_running;		/* beep in progress */
+int beep_wpos;			/* frames written so far */
+int beep_ppos;			/* frames played so far */
+int beep_end;			/* frames to write for this beep */
+int beep_buflen;		/* frames to fill the buffer */
+long long beep_use_time;	/* mtime() of the last beep */
+int16_t *beep_data;		/* tone being played, NULL for silence */
+int16_t tone_data[TONE_COUNT][BELL_LEN];
+int tone_ready;
+
+/*
+ * In threaded mode, the feedback thread owns the bell device and
+ * the variables above. The main thread posts beep requests in a
+ * single-producer, single-consumer queue: the tail is written by
+ * the main thread only, the head by the feedback thread only
+ */
+int beep_threaded;
+pthread_t beep_thread;
+int beep_wakefd[2];		/* pipe to wake up the feedback thread */
+atomic_int beep_quit;
+atomic_uint beep_qhead, beep_qtail;
+struct beep_req {
+	int tone;
+	long long time;			/* mtime() of the request */
+} beep_queue[BEEP_QUEUELEN];
+pthread_mutex_t log_mtx = PTHREAD_MUTEX_INITIALIZER;
+int ctl_eager;
+int ctl_rate;			/* max updates per second of a control */
+int ramp_rate;			/* ramp steps per second, 0 if disabled */
+int ramp_count;			/* number of keys ramping */
+int idle_timo;			/* ms before closing unused devices, or 0 */
+
+struct trace_rec {
+	uint32_t time;			/* us since the previous record, clamped */
+	uint32_t len;			/* bytes of payload */
+	uint32_t a, b;			/* depend on the type */
+	uint8_t type, arg;
+	uint16_t unused;
+};
+FILE *trace_file;
+long long trace_time;		/* ustime() of the last record */
+int trace_ndevs;		/* devices numbered so far */
+int trace_pending;		/* records since the last TRACE_FLUSH */
+char *trace_buf;		/* payload of the next record */
+size_t trace_used, trace_size;
+int maxfds;			/* fds needed by all handles */
+struct pollfd *pfds;		/* X connection first, then sndio handles */
+int pfds_size;
 
 int verbose;
 int silent;
+int step_log;
+int step_accel;
 int beep_pending;
+int beep_tone;
+int beep_hot;
 int audible_bell;
 
+struct timing {
+	char *name;
+	unsigned int count;
+	long long max;
+	unsigned int hist[TIMING_NBUCKET];
+} timing_tab[TIMING_COUNT] = {
+	{"key to setval"},
+	{"setval to onval"},
+	{"beep"}
+};
+int timing;
+volatile sig_atomic_t timing_dump_pending;
+
+/*
+ * Counters reported on the control socket
+ */
+unsigned long stat_events;	/* X events handled */
+unsigned long stat_setvals;	/* sioctl_setval() calls */
+unsigned long stat_beeps;	/* beeps requested */
+unsigned long stat_regrabs;	/* key grab updates */
+unsigned long stat_wakeups;	/* returns from poll() in the main loop */
+
+/*
+ * Control socket and its connections
+ */
+char *sock_path;
+int sock_fd = -1;
+int sock_pfd;			/* index in pfds, -1 if not polled */
+struct client {
+	struct client *next;
+	int fd;
+	int pfd;			/* index in pfds, -1 if not polled */
+	int used;
+	char buf[CLIENT_BUFSZ];
+} *client_list;
+long long key_time;		/* time of the current key press */
+
+char log_buf[LOG_BUFSZ];
+int log_start, log_used;
+unsigned int log_drops;		/* messages not logged since last report */
+struct lograte {
+	const char *fmt;
+	long long sec;
+	int count;
+} log_rate[LOG_NRATE];
+
+/*
+ * return the monotonic time in milliseconds
+ */
+static long long
+mtime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * reduce the poll() timeout so that it expires within the given delay
+ */
 static void
-beep_close(void)
+timo_set(int *timo, long long delay)
 {
-	maxfds -= beep_maxfds;
-	sio_close(beep_hdl);
-	beep_hdl = NULL;
+	if (delay < 0)
+		delay = 0;
+	if (*timo < 0 || delay < *timo)
+		*timo = delay;
 }
 
+/*
+ * append the string to the log ring, return 0 if there's not enough
+ * space
+ */
 static int
-beep_open(void)
+log_append(char *str, size_t len)
 {
-	struct sio_par par;
+	size_t end, n;
 
-	beep_hdl = sio_open(dev_name, SIO_PLAY, 0);
-	if (beep_hdl == NULL) {
-		logx(1, "bell: failed to open audio device");
+	if (len > LOG_BUFSZ - log_used)
 		return 0;
+	while (len > 0) {
+		end = (log_start + log_used) % LOG_BUFSZ;
+		n = LOG_BUFSZ - end;
+		if (n > len)
+			n = len;
+		memcpy(log_buf + end, str, n);
+		log_used += n;
+		str += n;
+		len -= n;
 	}
+	return 1;
+}
 
-	sio_initpar(&par);
-	par.bits = 16;
-	par.rate = BELL_RATE;
-	par.pchan = 1;
+/*
+ * format and store a log message, see logx()
+ */
+static void __attribute__((format(printf, 1, 2)))
+log_put(const char *fmt, ...)
+{
+	char line[LOG_LINEMAX];
+	struct lograte *r;
+	va_list ap;
+	long long sec;
+	int len;
 
-	if (!sio_setpar(beep_hdl, &par) || !sio_getpar(beep_hdl, &par)) {
-		logx(1, "bell: failed to set parameters");
-		goto err_close;
+	if (beep_threaded)
+		pthread_mutex_lock(&log_mtx);
+
+	sec = mtime() / 1000;
+	r = &log_rate[((uintptr_t)fmt >> 2) % LOG_NRATE];
+	if (r->fmt != fmt || r->sec != sec) {
+		r->fmt = fmt;
+		r->sec = sec;
+		r->count = 0;
+	}
+	if (++r->count > LOG_RATE) {
+		log_drops++;
+		goto done;
 	}
 
-	if (par.bits != 16 || par.bps != 2 || par.le != SIO_LE_NATIVE ||
-	    par.pchan != 1 || par.rate != BELL_RATE) {
-		logx(1, "bell: bad parameters");
-		goto err_close;
+	if (log_drops > 0) {
+		len = snprintf(line, sizeof(line),
+		    "%u log messages dropped\n", log_drops);
+		if (!log_append(line, len)) {
+			log_drops++;
+			goto done;
+		}
+		log_drops = 0;
 	}
-	beep_maxfds = sio_nfds(beep_hdl);
-	if (beep_maxfds + maxfds >= MAXFDS) {
-		logx(1, "%s: too many fds", dev_name);
-		goto err_close;
+
+	va_start(ap, fmt);
+	len = vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+	if (len < 0)
+		goto done;
+	if (len >= sizeof(line)) {
+		len = sizeof(line) - 1;
+		line[len - 1] = '\n';
 	}
-	maxfds += beep_maxfds;
-	return 1;
-err_close:
-	sio_close(beep_hdl);
-	beep_hdl = NULL;
-	return 0;
+	if (!log_append(line, len))
+		log_drops++;
+done:
+	if (beep_threaded)
+		pthread_mutex_unlock(&log_mtx);
 }
 
 /*
- * Play a short beep. It's used as sonic feedback and/or keyboard bell
+ * write logged messages to stderr; if nonblock is set, write at
+ * most PIPE_BUF bytes, which doesn't block once poll() reported the
+ * fd as writable
  */
 static void
-beep_play(void)
+log_flush(int nonblock)
 {
-	int16_t data[BELL_LEN];
-	int i;
+	ssize_t n;
+	size_t count;
 
-	if (beep_hdl == NULL) {
-		if (!beep_open())
-			return;
-	}
-	if (!sio_start(beep_hdl)) {
-		logx(1, "bell: failed to start playback");
-		return;
-	}
-	for (i = 0; i < BELL_LEN; i++) {
-		data[i] = (i % BELL_PERIOD) < (BELL_PERIOD / 2) ?
-		    BELL_AMP : -BELL_AMP;
-	}
-	if (sio_write(beep_hdl, data, sizeof(data)) != sizeof(data)) {
-		logx(1, "bell: short write");
-		return;
+	if (beep_threaded)
+		pthread_mutex_lock(&log_mtx);
+	while (log_used > 0) {
+		count = LOG_BUFSZ - log_start;
+		if (count > log_used)
+			count = log_used;
+		if (nonblock && count > PIPE_BUF)
+			count = PIPE_BUF;
+		n = write(STDERR_FILENO, log_buf + log_start, count);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			log_used = 0;
+			break;
+		}
+		log_start = (log_start + n) % LOG_BUFSZ;
+		log_used -= n;
+		if (nonblock)
+			break;
 	}
-	sio_stop(beep_hdl);
+	if (log_used == 0)
+		log_start = 0;
+	if (beep_threaded)
+		pthread_mutex_unlock(&log_mtx);
 }
 
 /*
- * compare two sioctl_desc structures, used to sort ctl_list
+ * write all pending messages, used at exit
  */
-static int
-cmpdesc(struct sioctl_desc *d1, struct sioctl_desc *d2)
+static void
+log_drain(void)
 {
-	int res;
+	log_flush(0);
+}
 
-	res = strcmp(d1->group, d2->group);
-	if (res != 0)
-		return res;
-	res = strcmp(d1->node0.name, d2->node0.name);
-	if (res != 0)
-		return res;
-	res = d1->type - d2->type;
-	if (res != 0)
-		return res;
-	res = strcmp(d1->func, d2->func);
-	if (res != 0)
-		return res;
-	res = d1->node0.unit - d2->node0.unit;
-	if (d1->type == SIOCTL_SEL) {
-		if (res != 0)
-			return res;
-		res = strcmp(d1->node1.name, d2->node1.name);
-		if (res != 0)
-			return res;
-		res = d1->node1.unit - d2->node1.unit;
-	}
-	return res;
+/*
+ * return the monotonic time in microseconds
+ */
+static long long
+ustime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
 /*
- * skip all parameters with the same group, name, and func
+ * account the given latency
  */
-static struct ctl *
-nextctl(struct ctl *i)
+static void
+timing_add(int id, long long usec)
 {
-	char *str, *group, *func;
-	int unit;
+	struct timing *t = &timing_tab[id];
+	int b;
 
-	group = i->desc.group;
-	func = i->desc.func;
-	str = i->desc.node0.name;
-	unit = i->desc.node0.unit;
-	for (i = i->next; i != NULL; i = i->next) {
-		if (strcmp(i->desc.group, group) != 0 ||
-		    strcmp(i->desc.node0.name, str) != 0 ||
-		    strcmp(i->desc.func, func) != 0 ||
-		    i->desc.node0.unit != unit)
-			return i;
-	}
-	return NULL;
+	for (b = 0; b < TIMING_NBUCKET - 1 && (1LL << b) <= usec; b++)
+		; /* nothing */
+	t->hist[b]++;
+	t->count++;
+	if (t->max < usec)
+		t->max = usec;
 }
 
 /*
- * move to the next selector entry or retrun NULL
+ * return the upper bound of the bucket containing the given
+ * percentile
  */
-static struct ctl *
-nextent(struct ctl *i)
+static long long
+timing_pct(struct timing *t, int pct)
 {
-	char *str, *group, *func;
-	int unit;
+	unsigned int sum;
+	int b;
 
-	group = i->desc.group;
-	func = i->desc.func;
-	str = i->desc.node0.name;
-	unit = i->desc.node0.unit;
-	for (i = i->next; i != NULL; i = i->next) {
-		if (strcmp(i->desc.group, group) != 0 ||
-		    strcmp(i->desc.node0.name, str) != 0 ||
-		    strcmp(i->desc.func, func) != 0)
-			return NULL;
-		if (i->desc.node0.unit == unit)
-			return i;
+	sum = 0;
+	for (b = 0; b < TIMING_NBUCKET - 1; b++) {
+		sum += t->hist[b];
+		if (sum * 100ULL >= (unsigned long long)t->count * pct)
+			break;
 	}
-	return NULL;
+	return 1LL << b;
 }
 
 /*
- * sndio call-back for added/removed controls
+ * log the latencies measured so far
  */
 static void
-ondesc(void *unused, struct sioctl_desc *desc, int val)
+timing_dump(void)
 {
-	struct ctl *i, **pi;
+	struct timing *t;
 
-	if (desc == NULL)
-		return;
-
-	for (pi = &ctl_list; (i = *pi) != NULL; pi = &i->next) {
-		if (desc->addr == i->desc.addr) {
-			*pi = i->next;
-			free(i);
-			break;
+	for (t = timing_tab; t != timing_tab + TIMING_COUNT; t++) {
+		if (t->count == 0) {
+			logx(0, "%s: no samples", t->name);
+			continue;
 		}
+		logx(0, "%s: %u samples, p50 < %lldus, p99 < %lldus, "
+		    "max %lldus", t->name, t->count,
+		    timing_pct(t, 50), timing_pct(t, 99), t->max);
 	}
+}
 
-	switch (desc->type) {
-	case SIOCTL_NUM:
-	case SIOCTL_SW:
-	case SIOCTL_SEL:
-		break;
-	default:
+/*
+ * create the self-pipe written by signal handlers. The pending flags
+ * are checked at the top of the main loop, so without it a signal
+ * received just before poll() would be handled only on the next
+ * unrelated wakeup
+ */
+static void
+sig_init(void)
+{
+	if (sig_fds[0] >= 0)
 		return;
-	}
-
-	/*
-	 * find the right position to insert the new widget
-	 */
-	for (pi = &ctl_list; (i = *pi) != NULL; pi = &i->next) {
-		if (cmpdesc(desc, &i->desc) <= 0)
-			break;
-	}
-
-	i = malloc(sizeof(struct ctl));
-	if (i == NULL) {
-		logx(1, "failed to allocate desc: %s", strerror(errno));
+	if (pipe(sig_fds) < 0 ||
+	    fcntl(sig_fds[0], F_SETFL, O_NONBLOCK) < 0 ||
+	    fcntl(sig_fds[1], F_SETFL, O_NONBLOCK) < 0) {
+		logx(1, "pipe: %s", strerror(errno));
 		exit(1);
 	}
-	i->desc = *desc;
-	i->val = val;
-	i->next = *pi;
-	*pi = i;
+	maxfds++;
 }
 
 /*
- * sndio call-back for control value/changes
+ * called from signal handlers, make poll() return
  */
 static void
-onval(void *unused, unsigned int addr, unsigned int val)
+sig_wakeup(void)
 {
-	struct ctl *i, *j;
+	int save_errno = errno;
 
-	logx(1, "onval: %d -> %d", addr, val);
-
-	i = ctl_list;
-	for (;;) {
-		if (i == NULL)
-			return;
-		if (i->desc.addr == addr)
-			break;
-		i = i->next;
-	}
+	(void)write(sig_fds[1], "", 1);
+	errno = save_errno;
+}
 
-	if (i->desc.type == SIOCTL_SEL) {
-		for (j = ctl_list; j != NULL; j = j->next) {
-			if (strcmp(i->desc.group, j->desc.group) != 0 ||
-			    strcmp(i->desc.node0.name, j->desc.node0.name) != 0 ||
-			    strcmp(i->desc.func, j->desc.func) != 0 ||
-			    i->desc.node0.unit != j->desc.node0.unit)
-				continue;
-			j->val = (i->desc.addr == j->desc.addr);
-		}
-	} else
-		i->val = val;
+static void
+sig_drain(void)
+{
+	char buf[16];
 
+	while (read(sig_fds[0], buf, sizeof(buf)) > 0)
+		; /* nothing */
 }
 
-static int
-ctl_open(void)
+static void
+timing_sigusr1(int sig)
 {
-	ctl_hdl = sioctl_open(dev_name, SIOCTL_READ | SIOCTL_WRITE, 0);
-	if (ctl_hdl == NULL) {
-		logx(1, "%s: couldn't open audio device", dev_name);
-		return 0;
-	}
-	sioctl_ondesc(ctl_hdl, ondesc, NULL);
-	sioctl_onval(ctl_hdl, onval, NULL);
-
-	ctl_maxfds = sioctl_nfds(ctl_hdl);
-	if (ctl_maxfds + maxfds >= MAXFDS) {
-		logx(1, "%s: too many fds", dev_name);
-		sioctl_close(ctl_hdl);
-		ctl_hdl = NULL;
-		return 0;
-	}
-	maxfds += ctl_maxfds;
-	return 1;
+	timing_dump_pending = 1;
+	sig_wakeup();
 }
 
+/*
+ * make the pollfd array large enough for all open handles. The X
+ * connection entry never changes, so it's set only when the array
+ * is allocated
+ */
 static void
-ctl_close(void)
+pfds_grow(void)
 {
-	struct ctl *c;
+	struct pollfd *p;
+	int size;
 
-	while ((c = ctl_list) != NULL) {
-		ctl_list = ctl_list->next;
-		free(c);
+	/* one more entry for stderr */
+	if (maxfds + 1 <= pfds_size)
+		return;
+	size = pfds_size ? pfds_size : 8;
+	while (size < maxfds + 1)
+		size *= 2;
+	p = reallocarray(pfds, size, sizeof(struct pollfd));
+	if (p == NULL) {
+		logx(1, "failed to allocate pollfds: %s", strerror(errno));
+		exit(1);
 	}
-	maxfds -= ctl_maxfds;
-	sioctl_close(ctl_hdl);
-	ctl_hdl = NULL;
+	pfds = p;
+	pfds_size = size;
+	pfds[0].fd = ConnectionNumber(dpy);
+	pfds[0].events = POLLIN;
 }
 
 static void
-setval_sel(struct ctl *first, int dir)
+beep_close(void)
 {
-	struct ctl *cur, *next;
-
-	if (dir != 0)
-		return;
+	beep_started = 0;
+	beep_running = 0;
+	if (!beep_threaded)
+		maxfds -= beep_maxfds;
+	sio_close(beep_hdl);
+	beep_hdl = NULL;
+}
 
-	/* find the current entry */
+/*
+ * synthesize all tones, done once as they don't depend on the device
+ */
+static void
+tone_init(void)
+{
+	struct tone *t;
+	int16_t *data;
+	int i, ph, period;
 
-	cur = first;
-	while (cur->val == 0) {
-		cur = nextent(cur);
-		if (cur == NULL) {
-			logx(1, "%d: no current value", first->desc.addr);
-			return;
+	for (t = tone_tab, data = tone_data[0];
+	     t != tone_tab + TONE_COUNT; t++, data += BELL_LEN) {
+		period = BELL_RATE / t->freq;
+		for (i = 0, ph = 0; i < BELL_LEN; i++) {
+			switch (t->shape) {
+			case SHAPE_TRIANGLE:
+				data[i] = ph < period / 2 ?
+				    -BELL_AMP + 4 * BELL_AMP * ph / period :
+				    3 * BELL_AMP - 4 * BELL_AMP * ph / period;
+				break;
+			default:
+				data[i] = ph < period / 2 ?
+				    BELL_AMP : -BELL_AMP;
+			}
+			if (++ph == period)
+				ph = 0;
+		}
+	}
+	tone_ready = 1;
+}
+
+/*
+ * sndio call-back for play position changes
+ */
+static void
+beep_onmove(void *unused, int delta)
+{
+	beep_ppos += delta;
+}
+
+static int
+beep_open(void)
+{
+	struct sio_par par;
+
+	beep_hdl = sio_open(dev_name, SIO_PLAY, 1);
+	if (beep_hdl == NULL) {
+		logx(1, "bell: failed to open audio device");
+		return 0;
+	}
+
+	sio_initpar(&par);
+	par.bits = 16;
+	par.rate = BELL_RATE;
+	par.pchan = 1;
+	par.appbufsz = BELL_LEN;
+
+	if (!sio_setpar(beep_hdl, &par) || !sio_getpar(beep_hdl, &par)) {
+		logx(1, "bell: failed to set parameters");
+		goto err_close;
+	}
+
+	if (par.bits != 16 || par.bps != 2 || par.le != SIO_LE_NATIVE ||
+	    par.pchan != 1 || par.rate != BELL_RATE) {
+		logx(1, "bell: bad parameters");
+		goto err_close;
+	}
+
+	/*
+	 * playback starts only once the buffer is full, so pad the
+	 * tone with silence if the buffer is larger than the tone
+	 */
+	beep_buflen = par.appbufsz > BELL_LEN ? par.appbufsz : BELL_LEN;
+	sio_onmove(beep_hdl, beep_onmove, NULL);
+	if (!tone_ready)
+		tone_init();
+
+	/*
+	 * in hot mode, start the stream right away and fill the
+	 * buffer with silence. Once idle, nothing is written and
+	 * the stream pauses until the next beep is written.
+	 */
+	if (beep_hot) {
+		if (!sio_start(beep_hdl)) {
+			logx(1, "bell: failed to start playback");
+			goto err_close;
+		}
+		beep_started = 1;
+		beep_data = NULL;
+		beep_end = beep_buflen;
+		beep_wpos = 0;
+		beep_ppos = 0;
+		beep_running = 1;
+	}
+
+	beep_maxfds = sio_nfds(beep_hdl);
+	if (!beep_threaded)
+		maxfds += beep_maxfds;
+	return 1;
+err_close:
+	sio_close(beep_hdl);
+	beep_hdl = NULL;
+	beep_started = 0;
+	beep_running = 0;
+	return 0;
+}
+
+/*
+ * Start playing a short beep. It's used as sonic feedback and/or
+ * keyboard bell. Samples are written by beep_write() from the main
+ * loop, as the device becomes writable.
+ */
+static void
+beep_play(int tone)
+{
+	beep_use_time = mtime();
+	if (beep_hdl == NULL) {
+		if (!beep_open())
+			return;
+
+		/*
+		 * in hot mode, nothing of the silence priming the buffer
+		 * is written yet, so write the tone in its place
+		 */
+		if (beep_started) {
+			beep_data = tone_data[tone];
+			return;
+		}
+	}
+	if (beep_running)
+		return;
+	if (beep_started)
+		beep_end = BELL_LEN;
+	else {
+		if (!sio_start(beep_hdl)) {
+			logx(1, "bell: failed to start playback");
+			return;
+		}
+		beep_started = 1;
+		beep_end = beep_buflen;
+	}
+	beep_data = tone_data[tone];
+	beep_wpos = 0;
+	beep_ppos = 0;
+	beep_running = 1;
+}
+
+/*
+ * Write as many samples as the device accepts without blocking, and
+ * stop the stream once everything is played, unless in hot mode.
+ */
+static void
+beep_write(void)
+{
+	static int16_t zero[BELL_LEN];
+	int16_t *data;
+	size_t n, count;
+
+	while (beep_wpos < beep_end) {
+		if (beep_wpos < BELL_LEN && beep_data != NULL) {
+			data = beep_data + beep_wpos;
+			count = BELL_LEN - beep_wpos;
+		} else {
+			data = zero;
+			count = beep_end - beep_wpos;
+			if (count > BELL_LEN)
+				count = BELL_LEN;
+		}
+		n = sio_write(beep_hdl, data, count * sizeof(int16_t));
+		beep_wpos += n / sizeof(int16_t);
+		if (n < count * sizeof(int16_t))
+			break;
+	}
+
+	/*
+	 * sio_stop() drains the buffer, so call it only once all
+	 * samples are played to avoid blocking
+	 */
+	if (beep_hot) {
+		if (beep_wpos >= beep_end)
+			beep_running = 0;
+	} else if (beep_ppos >= beep_end) {
+		sio_stop(beep_hdl);
+		beep_started = 0;
+		beep_running = 0;
+	}
+}
+
+/*
+ * return true if no beep was played for the idle timeout
+ */
+static int
+beep_isidle(void)
+{
+	return idle_timo > 0 && mtime() - beep_use_time >= idle_timo;
+}
+
+/*
+ * close the bell device once idle, to free its sndiod stream. Tones
+ * are kept, so the next beep only needs to reopen it
+ */
+static void
+beep_idle(int *timo)
+{
+	if (idle_timo == 0 || beep_hdl == NULL || beep_running)
+		return;
+	if (beep_isidle()) {
+		logx(2, "bell: idle, closed");
+		beep_close();
+	} else
+		timo_set(timo, beep_use_time + idle_timo - mtime());
+}
+
+/*
+ * feedback thread: play the requested beeps and feed the bell
+ * device. Only the latest request is played, as in the main loop
+ */
+static void *
+beep_thread_main(void *unused)
+{
+	struct pollfd *fds, *p;
+	struct beep_req *r;
+	unsigned int head, tail;
+	char buf[16];
+	int nfds, fds_size, timo, tone, revents;
+
+	fds = NULL;
+	fds_size = 0;
+	while (!atomic_load(&beep_quit)) {
+		while (read(beep_wakefd[0], buf, sizeof(buf)) > 0)
+			; /* nothing */
+
+		tone = -1;
+		head = atomic_load_explicit(&beep_qhead, memory_order_relaxed);
+		tail = atomic_load_explicit(&beep_qtail, memory_order_acquire);
+		for (; head != tail; head++) {
+			r = &beep_queue[head % BEEP_QUEUELEN];
+			if (mtime() - r->time < BEEP_MAXAGE)
+				tone = r->tone;
+		}
+		atomic_store_explicit(&beep_qhead, head, memory_order_release);
+		if (tone >= 0)
+			beep_play(tone);
+
+		timo = -1;
+		if (beep_hot && beep_hdl == NULL &&
+		    (!silent || audible_bell) && !beep_isidle()) {
+			if (!beep_open())
+				timo = BELL_RETRY;
+		}
+		beep_idle(&timo);
+
+		if (fds_size < 1 + beep_maxfds) {
+			p = reallocarray(fds, 1 + beep_maxfds,
+			    sizeof(struct pollfd));
+			if (p == NULL) {
+				logx(1, "bell: failed to allocate pollfds: %s",
+				    strerror(errno));
+				exit(1);
+			}
+			fds = p;
+			fds_size = 1 + beep_maxfds;
+		}
+		fds[0].fd = beep_wakefd[0];
+		fds[0].events = POLLIN;
+		nfds = 1;
+		if (beep_hdl) {
+			nfds += sio_pollfd(beep_hdl, fds + 1,
+			    beep_running && beep_wpos < beep_end ?
+			    POLLOUT : 0);
+		}
+		if (poll(fds, nfds, timo) < 0) {
+			if (errno == EINTR)
+				continue;
+			logx(1, "bell: poll: %s", strerror(errno));
+			exit(1);
+		}
+		if (beep_hdl) {
+			revents = sio_revents(beep_hdl, fds + 1);
+			if (revents & POLLHUP) {
+				logx(1, "sndio: beep hup");
+				beep_close();
+			} else if (beep_running)
+				beep_write();
+		}
+	}
+	free(fds);
+	if (beep_hdl)
+		beep_close();
+	return NULL;
+}
+
+/*
+ * start the feedback thread, with all signals blocked so they are
+ * handled by the main thread
+ */
+static void
+beep_thread_start(void)
+{
+	sigset_t set, oset;
+	int err;
+
+	if (pipe(beep_wakefd) < 0 ||
+	    fcntl(beep_wakefd[0], F_SETFL, O_NONBLOCK) < 0 ||
+	    fcntl(beep_wakefd[1], F_SETFL, O_NONBLOCK) < 0) {
+		logx(1, "bell: pipe: %s", strerror(errno));
+		exit(1);
+	}
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &oset);
+	err = pthread_create(&beep_thread, NULL, beep_thread_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &oset, NULL);
+	if (err != 0) {
+		logx(1, "bell: failed to create thread: %s", strerror(err));
+		exit(1);
+	}
+}
+
+static void
+beep_thread_stop(void)
+{
+	atomic_store(&beep_quit, 1);
+	(void)write(beep_wakefd[1], "", 1);
+	pthread_join(beep_thread, NULL);
+	close(beep_wakefd[0]);
+	close(beep_wakefd[1]);
+}
+
+/*
+ * post a beep request to the feedback thread. If the queue is
+ * full, the thread is stuck and the beep would be late anyway
+ */
+static void
+beep_post(int tone)
+{
+	struct beep_req *r;
+	unsigned int head, tail;
+
+	tail = atomic_load_explicit(&beep_qtail, memory_order_relaxed);
+	head = atomic_load_explicit(&beep_qhead, memory_order_acquire);
+	if (tail - head == BEEP_QUEUELEN)
+		return;
+	r = &beep_queue[tail % BEEP_QUEUELEN];
+	r->tone = tone;
+	r->time = mtime();
+	atomic_store_explicit(&beep_qtail, tail + 1, memory_order_release);
+	(void)write(beep_wakefd[1], "", 1);
+}
+
+/*
+ * play a beep, or ask the feedback thread to
+ */
+static void
+beep_request(int tone)
+{
+	stat_beeps++;
+	if (beep_threaded)
+		beep_post(tone);
+	else
+		beep_play(tone);
+}
+
+/*
+ * return the atom for the given string, creating it if needed
+ */
+static int
+atom(char *name)
+{
+	struct atom *a, **pa;
+	unsigned int h;
+	char *p;
+
+	h = 0;
+	for (p = name; *p != 0; p++)
+		h = h * 31 + (unsigned char)*p;
+
+	pa = &atom_hash[h & (ATOM_NHASH - 1)];
+	for (a = *pa; a != NULL; a = a->next) {
+		if (strcmp(a->name, name) == 0)
+			return a->id;
+	}
+
+	a = malloc(sizeof(struct atom) + strlen(name));
+	if (a == NULL) {
+		logx(1, "failed to allocate atom: %s", strerror(errno));
+		exit(1);
+	}
+	strcpy(a->name, name);
+	if (atom_count == atom_size) {
+		atom_size = atom_size ? 2 * atom_size : 64;
+		atom_tab = reallocarray(atom_tab,
+		    atom_size, sizeof(struct atom *));
+		if (atom_tab == NULL) {
+			logx(1, "failed to allocate atoms: %s",
+			    strerror(errno));
+			exit(1);
+		}
+	}
+	a->id = atom_count++;
+	atom_tab[a->id] = a;
+	a->next = *pa;
+	*pa = a;
+	return a->id;
+}
+
+/*
+ * return the string of the given atom
+ */
+static char *
+atom_name(int id)
+{
+	return atom_tab[id]->name;
+}
+
+/*
+ * free all atoms
+ */
+static void
+atom_done(void)
+{
+	struct atom *a;
+	int i;
+
+	for (i = 0; i < ATOM_NHASH; i++) {
+		while ((a = atom_hash[i]) != NULL) {
+			atom_hash[i] = a->next;
+			free(a);
+		}
+	}
+	free(atom_tab);
+	atom_tab = NULL;
+	atom_count = atom_size = 0;
+}
+
+/*
+ * compare the strings of two atoms, skipping strcmp() if equal
+ */
+static int
+cmpatom(int a1, int a2)
+{
+	return a1 == a2 ? 0 : strcmp(atom_name(a1), atom_name(a2));
+}
+
+/*
+ * compare two controls, used to sort ctl_list
+ */
+static int
+cmpctl(struct ctl *c1, struct ctl *c2)
+{
+	int res;
+
+	res = cmpatom(c1->group, c2->group);
+	if (res != 0)
+		return res;
+	res = cmpatom(c1->node0, c2->node0);
+	if (res != 0)
+		return res;
+	res = c1->type - c2->type;
+	if (res != 0)
+		return res;
+	res = cmpatom(c1->func, c2->func);
+	if (res != 0)
+		return res;
+	res = c1->unit0 - c2->unit0;
+	if (c1->type == SIOCTL_SEL) {
+		if (res != 0)
+			return res;
+		res = cmpatom(c1->node1, c2->node1);
+		if (res != 0)
+			return res;
+		res = c1->unit1 - c2->unit1;
+	}
+	return res;
+}
+
+/*
+ * skip all parameters with the same group, name, and func
+ */
+static struct ctl *
+nextctl(struct ctl *i)
+{
+	int group, node0, func, unit;
+
+	group = i->group;
+	func = i->func;
+	node0 = i->node0;
+	unit = i->unit0;
+	for (i = i->next; i != NULL; i = i->next) {
+		if (i->group != group ||
+		    i->node0 != node0 ||
+		    i->func != func ||
+		    i->unit0 != unit)
+			return i;
+	}
+	return NULL;
+}
+
+/*
+ * move to the next selector entry or retrun NULL
+ */
+static struct ctl *
+nextent(struct ctl *i)
+{
+	int group, node0, func, unit;
+
+	group = i->group;
+	func = i->func;
+	node0 = i->node0;
+	unit = i->unit0;
+	for (i = i->next; i != NULL; i = i->next) {
+		if (i->group != group ||
+		    i->node0 != node0 ||
+		    i->func != func)
+			return NULL;
+		if (i->unit0 == unit)
+			return i;
+	}
+	return NULL;
+}
+
+/*
+ * rebuild the list of controls the key acts on
+ */
+static void
+key_resolve(struct key *key)
+{
+	struct ctl *i, **p;
+
+	key->nctls = 0;
+	for (i = key->dev->ctl_list; i != NULL; i = nextctl(i)) {
+		if (i->group != atom_empty ||
+		    i->node0 != key->name || i->func != key->func)
+			continue;
+		if (key->nctls == key->maxctls) {
+			key->maxctls = key->maxctls ? 2 * key->maxctls : 4;
+			p = reallocarray(key->ctls,
+			    key->maxctls, sizeof(struct ctl *));
+			if (p == NULL) {
+				logx(1, "failed to allocate ctls: %s",
+				    strerror(errno));
+				exit(1);
+			}
+			key->ctls = p;
+		}
+		key->ctls[key->nctls++] = i;
+	}
+}
+
+/*
+ * update the keys that act on the control, after it was added
+ * or removed
+ */
+static void
+key_update(struct ctl *c)
+{
+	struct key *key;
+
+	if (c->group != atom_empty)
+		return;
+	for (key = key_list; key != NULL; key = key->next) {
+		if (key->dev == c->dev &&
+		    key->name == c->node0 && key->func == c->func)
+			key_resolve(key);
+	}
+}
+
+/*
+ * return true if both controls belong to the same selector/group
+ */
+static int
+samegroup(struct ctl *i, struct ctl *j)
+{
+	return i->group == j->group &&
+	    i->node0 == j->node0 &&
+	    i->func == j->func &&
+	    i->unit0 == j->unit0;
+}
+
+/*
+ * allocate a control in the pool of the device
+ */
+static struct ctl *
+ctl_alloc(struct dev *d)
+{
+	struct ctl_pool *p;
+	struct ctl *c;
+
+	if ((c = d->ctl_free) != NULL) {
+		d->ctl_free = c->next;
+		return c;
+	}
+	if (d->ctl_pool == NULL || d->ctl_pool_used == CTL_POOLSZ) {
+		p = malloc(sizeof(struct ctl_pool));
+		if (p == NULL) {
+			logx(1, "failed to allocate desc: %s", strerror(errno));
+			exit(1);
+		}
+		p->next = d->ctl_pool;
+		d->ctl_pool = p;
+		d->ctl_pool_used = 0;
+	}
+	return &d->ctl_pool->ctls[d->ctl_pool_used++];
+}
+
+/*
+ * return an unlinked control to the pool of the device
+ */
+static void
+ctl_free(struct ctl *c)
+{
+	struct dev *d = c->dev;
+
+	c->next = d->ctl_free;
+	d->ctl_free = c;
+}
+
+/*
+ * find the control with the given address
+ */
+static struct ctl *
+ctl_byaddr(struct dev *d, unsigned int addr)
+{
+	struct ctl *i;
+
+	for (i = d->ctl_hash[CTL_HASH(addr)]; i != NULL; i = i->hash_next) {
+		if (i->addr == addr)
+			return i;
+	}
+	return NULL;
+}
+
+/*
+ * remove the control from the list and the address table
+ */
+static void
+ctl_unlink(struct ctl *i)
+{
+	struct dev *d = i->dev;
+	struct ctl **pi;
+
+	if (i->prev)
+		i->prev->next = i->next;
+	else
+		d->ctl_list = i->next;
+	if (i->next)
+		i->next->prev = i->prev;
+
+	for (pi = &d->ctl_hash[CTL_HASH(i->addr)]; *pi != i;
+	     pi = &(*pi)->hash_next)
+		; /* nothing */
+	*pi = i->hash_next;
+
+	if (i->dirty) {
+		for (pi = &d->ctl_dirty; *pi != i; pi = &(*pi)->dirty_next)
+			; /* nothing */
+		*pi = i->dirty_next;
+	}
+}
+
+/*
+ * mark the control value as changed, it will be sent by ctl_flush()
+ */
+static void
+ctl_setdirty(struct ctl *i)
+{
+	if (i->dirty)
+		return;
+	i->key_time = key_time;
+	i->dirty = 1;
+	i->dirty_next = i->dev->ctl_dirty;
+	i->dev->ctl_dirty = i;
+}
+
+/*
+ * save the controls of all devices, so they are known before the
+ * devices are connected, next time the program is started
+ */
+static void
+cache_save(void)
+{
+	char tmp[PATH_MAX];
+	struct dev *d;
+	struct ctl *i;
+	FILE *f;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", cache_path) >= sizeof(tmp)) {
+		logx(1, "%s: path too long", cache_path);
+		return;
+	}
+	f = fopen(tmp, "w");
+	if (f == NULL) {
+		logx(1, "%s: %s", tmp, strerror(errno));
+		return;
+	}
+	fprintf(f, "sndiokeys-cache\t1\n");
+	for (d = dev_list; d != NULL; d = d->next) {
+		if (d->ctl_loading || d->ctl_list == NULL)
+			continue;
+		fprintf(f, "dev\t%s\n", d->name);
+		for (i = d->ctl_list; i != NULL; i = i->next) {
+			fprintf(f, "ctl\t%u\t%d\t%u\t%d\t%d\t%d"
+			    "\t%s\t%s\t%s\t%s\n",
+			    i->addr, i->type, i->maxval, i->val,
+			    i->unit0, i->unit1,
+			    atom_name(i->group), atom_name(i->node0),
+			    atom_name(i->func), atom_name(i->node1));
+		}
+	}
+	if (fclose(f) != 0 || rename(tmp, cache_path) < 0) {
+		logx(1, "%s: %s", cache_path, strerror(errno));
+		unlink(tmp);
+	}
+}
+
+/*
+ * return true if both controls have the same address and description
+ */
+static int
+ctl_same(struct ctl *i, struct ctl *j)
+{
+	return i->addr == j->addr && i->type == j->type &&
+	    i->maxval == j->maxval && i->group == j->group &&
+	    i->node0 == j->node0 && i->unit0 == j->unit0 &&
+	    i->func == j->func && i->node1 == j->node1 &&
+	    i->unit1 == j->unit1;
+}
+
+/*
+ * move the values changed while disconnected from the snapshot to
+ * the controls of the dump, and free the snapshot. Values of controls
+ * that don't match the dump are dropped
+ */
+static void
+ctl_merge(struct dev *d)
+{
+	struct ctl *s, *i, *j;
+
+	d->ctl_dirty = NULL;
+	while ((s = d->ctl_stale) != NULL) {
+		d->ctl_stale = s->next;
+		if (s->dirty) {
+			i = ctl_byaddr(d, s->addr);
+			if (i == NULL || !ctl_same(i, s)) {
+				logx(1, "%s: %u: control changed, value dropped",
+				    d->name, s->addr);
+			} else if (i->val != s->val) {
+				if (i->type == SIOCTL_SEL) {
+					for (j = i->prev; j != NULL &&
+					     samegroup(i, j); j = j->prev)
+						j->val = 0;
+					for (j = i->next; j != NULL &&
+					     samegroup(i, j); j = j->next)
+						j->val = 0;
+				}
+				i->val = s->val;
+				ctl_setdirty(i);
+			}
+		}
+		ctl_free(s);
+	}
+}
+
+static int
+cmpctl_sort(const void *p1, const void *p2)
+{
+	return cmpctl(*(struct ctl **)p1, *(struct ctl **)p2);
+}
+
+/*
+ * sort the controls of the initial dump, with a single qsort(),
+ * and attach them to the keys
+ */
+static void
+ctl_sort(struct dev *d)
+{
+	struct ctl *i, **tab;
+	struct key *key;
+	int n, count;
+
+	count = 0;
+	for (i = d->ctl_list; i != NULL; i = i->next)
+		count++;
+
+	if (count > 1) {
+		tab = reallocarray(NULL, count, sizeof(struct ctl *));
+		if (tab == NULL) {
+			logx(1, "failed to allocate ctls: %s", strerror(errno));
+			exit(1);
+		}
+		n = 0;
+		for (i = d->ctl_list; i != NULL; i = i->next)
+			tab[n++] = i;
+		qsort(tab, count, sizeof(struct ctl *), cmpctl_sort);
+		for (n = 0; n < count; n++) {
+			tab[n]->prev = n > 0 ? tab[n - 1] : NULL;
+			tab[n]->next = n < count - 1 ? tab[n + 1] : NULL;
+		}
+		d->ctl_list = tab[0];
+		free(tab);
+	}
+
+	for (key = key_list; key != NULL; key = key->next) {
+		if (key->dev == d)
+			key_resolve(key);
+	}
+}
+
+/*
+ * append data to the payload of the next record
+ */
+static void
+trace_put(void *data, size_t len)
+{
+	char *p;
+	size_t size;
+
+	if (trace_used + len > trace_size) {
+		size = trace_size ? trace_size : 256;
+		while (size < trace_used + len)
+			size *= 2;
+		p = realloc(trace_buf, size);
+		if (p == NULL) {
+			logx(1, "failed to allocate trace buffer: %s",
+			    strerror(errno));
+			exit(1);
+		}
+		trace_buf = p;
+		trace_size = size;
+	}
+	memcpy(trace_buf + trace_used, data, len);
+	trace_used += len;
+}
+
+static void
+trace_put32(uint32_t val)
+{
+	trace_put(&val, sizeof(uint32_t));
+}
+
+static void
+trace_putstr(char *str)
+{
+	trace_put(str, strlen(str) + 1);
+}
+
+/*
+ * append the keymap: range of codes, width and keysyms
+ */
+static void
+trace_putkeymap(void)
+{
+	int i, n;
+
+	n = (keymap_max - keymap_min + 1) * keymap_width;
+	trace_put32(keymap_min);
+	trace_put32(keymap_max);
+	trace_put32(keymap_width);
+	for (i = 0; i < n; i++)
+		trace_put32(keymap[i]);
+}
+
+static void
+trace_close(void)
+{
+	if (fclose(trace_file) == EOF)
+		logx(1, "%s: %s", trace_path, strerror(errno));
+	trace_file = NULL;
+}
+
+/*
+ * write a record with the payload appended so far
+ */
+static void
+trace_write(int type, int arg, uint32_t a, uint32_t b)
+{
+	struct trace_rec r;
+	long long now;
+
+	/* stopped on error while building a multi-record event */
+	if (trace_file == NULL) {
+		trace_used = 0;
+		return;
+	}
+
+	/* idle gaps over 71 minutes are shortened, they are idle anyway */
+	now = ustime();
+	r.time = now - trace_time < UINT32_MAX ? now - trace_time : UINT32_MAX;
+	r.len = trace_used;
+	r.a = a;
+	r.b = b;
+	r.type = type;
+	r.arg = arg;
+	r.unused = 0;
+	trace_time = now;
+	trace_used = 0;
+	trace_pending = (type != TRACE_FLUSH);
+	if (fwrite(&r, sizeof(struct trace_rec), 1, trace_file) != 1 ||
+	    (r.len > 0 && fwrite(trace_buf, r.len, 1, trace_file) != 1)) {
+		logx(1, "%s: %s, tracing stopped", trace_path, strerror(errno));
+		trace_close();
+	}
+}
+
+/*
+ * open the trace file and write its header, with the options the
+ * dispatch code depends on
+ */
+static void
+trace_open(void)
+{
+	trace_file = fopen(trace_path, "w");
+	if (trace_file == NULL) {
+		logx(1, "%s: %s", trace_path, strerror(errno));
+		exit(1);
+	}
+	trace_time = ustime();
+	trace_put32(step_accel);
+	trace_put32(step_log);
+	trace_put32(ctl_rate);
+	trace_put32(ramp_rate);
+	trace_write(TRACE_HEADER, 0, TRACE_MAGIC, TRACE_VERSION);
+}
+
+/*
+ * write buffered records, called once per main loop iteration
+ */
+static void
+trace_flush(void)
+{
+	if (fflush(trace_file) == EOF) {
+		logx(1, "%s: %s, tracing stopped", trace_path, strerror(errno));
+		trace_close();
+	}
+}
+
+/*
+ * return the number of the device in the trace, the first time
+ * write a record with its name
+ */
+static int
+trace_dev(struct dev *d)
+{
+	if (d->trace_id == 0) {
+		d->trace_id = ++trace_ndevs;
+		trace_putstr(d->name);
+		trace_write(TRACE_DEV, d->trace_id, 0, 0);
+	}
+	return d->trace_id;
+}
+
+/*
+ * write the bindings with their codes, and the keymap they use
+ */
+static void
+trace_keys(void)
+{
+	struct key *key;
+	int nkeys;
+
+	if (keymap == NULL)
+		return;
+	nkeys = 0;
+	for (key = key_list; key != NULL; key = key->next) {
+		trace_dev(key->dev);
+		nkeys++;
+	}
+	trace_putkeymap();
+	for (key = key_list; key != NULL; key = key->next) {
+		trace_put32(key->modmask);
+		trace_put32(key->sym);
+		trace_put32(key->code);
+		trace_put32(key->dir);
+		trace_put32(key->dev->trace_id);
+		trace_putstr(atom_name(key->name));
+		trace_putstr(atom_name(key->func));
+	}
+	trace_write(TRACE_KEYS, 0, nkeys, 0);
+}
+
+/*
+ * mark the point where the main loop flushes the controls, so the
+ * replay coalesces changes the same way. Skipped if there's no
+ * event, dirty control or ramp since the last mark
+ */
+static void
+trace_loop(void)
+{
+	struct dev *d;
+
+	if (!trace_pending && ramp_count == 0) {
+		for (d = dev_list; d != NULL; d = d->next) {
+			if (d->ctl_dirty)
+				break;
+		}
+		if (d == NULL)
+			return;
+	}
+	trace_write(TRACE_FLUSH, 0, 0, 0);
+}
+
+static void
+trace_desc(struct dev *d, struct sioctl_desc *desc, int val)
+{
+	int id;
+
+	id = trace_dev(d);
+	if (desc == NULL) {
+		trace_write(TRACE_DESCEND, id, 0, 0);
+		return;
+	}
+	trace_put32(desc->type);
+	trace_put32(desc->maxval);
+	trace_put32(desc->node0.unit);
+	trace_put32(desc->node1.unit);
+	trace_putstr(desc->group);
+	trace_putstr(desc->node0.name);
+	trace_putstr(desc->func);
+	trace_putstr(desc->node1.name);
+	trace_write(TRACE_DESC, id, desc->addr, val);
+}
+
+/*
+ * sndio call-back for added/removed controls. During the initial
+ * dump, controls are just prepended to the list, which is sorted
+ * once the dump ends, i.e. when desc is NULL
+ */
+static void
+ondesc(void *arg, struct sioctl_desc *desc, int val)
+{
+	struct dev *d = arg;
+	struct ctl *c, *i, *prev, **pi;
+
+	if (trace_file)
+		trace_desc(d, desc, val);
+
+	if (desc == NULL) {
+		if (d->ctl_loading) {
+			d->ctl_loading = 0;
+			ctl_sort(d);
+			if (d->ctl_stale != NULL)
+				ctl_merge(d);
+			if (cache_path)
+				cache_save();
+		}
+		return;
+	}
+
+	i = ctl_byaddr(d, desc->addr);
+	if (i != NULL) {
+		ctl_unlink(i);
+		if (!d->ctl_loading)
+			key_update(i);
+		ctl_free(i);
+	}
+
+	switch (desc->type) {
+	case SIOCTL_NUM:
+	case SIOCTL_SW:
+	case SIOCTL_SEL:
+		break;
+	default:
+		return;
+	}
+
+	c = ctl_alloc(d);
+	c->dev = d;
+	c->addr = desc->addr;
+	c->type = desc->type;
+	c->maxval = desc->maxval;
+	c->unit0 = desc->node0.unit;
+	c->unit1 = desc->node1.unit;
+	c->group = atom(desc->group);
+	c->node0 = atom(desc->node0.name);
+	c->func = atom(desc->func);
+	c->node1 = atom(desc->node1.name);
+	c->val = val;
+	c->dirty = 0;
+	c->setval_time = 0;
+	c->send_time = 0;
+
+	pi = &d->ctl_hash[CTL_HASH(desc->addr)];
+	c->hash_next = *pi;
+	*pi = c;
+
+	if (d->ctl_loading) {
+		c->prev = NULL;
+		c->next = d->ctl_list;
+		if (c->next)
+			c->next->prev = c;
+		d->ctl_list = c;
+		return;
+	}
+
+	/*
+	 * find the right position to insert the new widget
+	 */
+	prev = NULL;
+	for (pi = &d->ctl_list; (i = *pi) != NULL; pi = &i->next) {
+		if (cmpctl(c, i) <= 0)
+			break;
+		prev = i;
+	}
+	c->prev = prev;
+	c->next = *pi;
+	if (c->next)
+		c->next->prev = c;
+	*pi = c;
+
+	key_update(c);
+}
+
+/*
+ * sndio call-back for control value/changes
+ */
+static void
+onval(void *arg, unsigned int addr, unsigned int val)
+{
+	struct dev *d = arg;
+	struct ctl *i, *j;
+
+	logx(1, "%s: onval: %d -> %d", d->name, addr, val);
+
+	if (trace_file)
+		trace_write(TRACE_VAL, trace_dev(d), addr, val);
+
+	i = ctl_byaddr(d, addr);
+	if (i == NULL)
+		return;
+
+	if (timing && i->setval_time) {
+		timing_add(TIMING_ECHO, ustime() - i->setval_time);
+		i->setval_time = 0;
+	}
+
+	/*
+	 * selector entries are sorted, so entries of the same
+	 * selector are adjacent to this one. During the initial
+	 * dump they are not, but sndiod sends every entry.
+	 *
+	 * A value not sent yet (held back by -r) is newer than the
+	 * echo of the previous one, so keep it
+	 */
+	if (i->type == SIOCTL_SEL && !d->ctl_loading) {
+		for (j = i; j->prev != NULL && samegroup(i, j->prev); j = j->prev)
+			; /* nothing */
+		for (; j != NULL && samegroup(i, j); j = j->next) {
+			if (j->dirty)
+				return;
+		}
+		for (j = i->prev; j != NULL && samegroup(i, j); j = j->prev)
+			j->val = 0;
+		for (j = i->next; j != NULL && samegroup(i, j); j = j->next)
+			j->val = 0;
+		i->val = 1;
+	} else if (!i->dirty)
+		i->val = val;
+}
+
+static int
+ctl_open(struct dev *d)
+{
+	d->ctl_hdl = sioctl_open(d->name, SIOCTL_READ | SIOCTL_WRITE, 0);
+	if (d->ctl_hdl == NULL) {
+		logx(1, "%s: couldn't open audio device", d->name);
+		return 0;
+	}
+	/*
+	 * controls kept while disconnected are replaced by the dump,
+	 * see ctl_merge()
+	 */
+	d->ctl_stale = d->ctl_list;
+	d->ctl_list = NULL;
+	d->ctl_dirty = NULL;
+	d->ctl_loading = 1;
+	d->use_time = mtime();
+	if (trace_file)
+		trace_write(TRACE_OPEN, trace_dev(d), 0, 0);
+	sioctl_ondesc(d->ctl_hdl, ondesc, d);
+	sioctl_onval(d->ctl_hdl, onval, d);
+
+	d->ctl_maxfds = sioctl_nfds(d->ctl_hdl);
+	maxfds += d->ctl_maxfds;
+	return 1;
+}
+
+/*
+ * free all the controls of the device
+ */
+static void
+ctl_clear(struct dev *d)
+{
+	struct ctl_pool *p;
+	struct key *key;
+
+	for (key = key_list; key != NULL; key = key->next) {
+		if (key->dev == d)
+			key->nctls = 0;
+	}
+	d->ctl_dirty = NULL;
+	d->ctl_list = NULL;
+	d->ctl_stale = NULL;
+	d->ctl_free = NULL;
+	d->ctl_loading = 0;
+	d->flush_time = 0;
+	while ((p = d->ctl_pool) != NULL) {
+		d->ctl_pool = p->next;
+		free(p);
+	}
+	memset(d->ctl_hash, 0, sizeof(d->ctl_hash));
+}
+
+/*
+ * disconnect from the device. In cache mode, the controls are kept
+ * as a snapshot so keys continue to work: the values are sent once
+ * the device is connected again
+ */
+static void
+ctl_close(struct dev *d)
+{
+	if (trace_file)
+		trace_write(TRACE_CLOSE, trace_dev(d), 0, 0);
+	maxfds -= d->ctl_maxfds;
+	sioctl_close(d->ctl_hdl);
+	d->ctl_hdl = NULL;
+
+	if (cache_path == NULL || d->ctl_loading) {
+		ctl_clear(d);
+		return;
+	}
+	memset(d->ctl_hash, 0, sizeof(d->ctl_hash));
+}
+
+/*
+ * load the controls saved by cache_save(). Devices not used anymore
+ * are skipped. On error, the controls loaded so far are kept, they
+ * are checked against the dump anyway
+ */
+static void
+cache_load(void)
+{
+	char *buf, *p, *field[11];
+	size_t bufsz;
+	struct dev *d;
+	struct ctl *c;
+	FILE *f;
+	int n, lineno;
+
+	f = fopen(cache_path, "r");
+	if (f == NULL) {
+		if (errno != ENOENT)
+			logx(1, "%s: %s", cache_path, strerror(errno));
+		return;
+	}
+
+	buf = NULL;
+	bufsz = 0;
+	d = NULL;
+	lineno = 0;
+	while (getline(&buf, &bufsz, f) != -1) {
+		lineno++;
+		buf[strcspn(buf, "\n")] = 0;
+		p = buf;
+		for (n = 0; n < 11 && p != NULL; n++)
+			field[n] = strsep(&p, "\t");
+		if (lineno == 1) {
+			if (n != 2 || strcmp(field[0], "sndiokeys-cache") != 0 ||
+			    strcmp(field[1], "1") != 0)
+				break;
+		} else if (n == 2 && strcmp(field[0], "dev") == 0) {
+			for (d = dev_list; d != NULL; d = d->next) {
+				if (strcmp(d->name, field[1]) == 0)
+					break;
+			}
+		} else if (n == 11 && p == NULL &&
+		    strcmp(field[0], "ctl") == 0) {
+			if (d == NULL)
+				continue;
+			c = ctl_alloc(d);
+			c->dev = d;
+			c->addr = strtoul(field[1], NULL, 10);
+			c->type = strtol(field[2], NULL, 10);
+			c->maxval = strtoul(field[3], NULL, 10);
+			c->val = strtol(field[4], NULL, 10);
+			c->unit0 = strtol(field[5], NULL, 10);
+			c->unit1 = strtol(field[6], NULL, 10);
+			c->group = atom(field[7]);
+			c->node0 = atom(field[8]);
+			c->func = atom(field[9]);
+			c->node1 = atom(field[10]);
+			c->dirty = 0;
+			c->setval_time = 0;
+			c->send_time = 0;
+			c->prev = NULL;
+			c->next = d->ctl_list;
+			if (c->next)
+				c->next->prev = c;
+			d->ctl_list = c;
+		} else {
+			logx(1, "%s:%d: bad line", cache_path, lineno);
+			break;
+		}
+	}
+	free(buf);
+	fclose(f);
+
+	for (d = dev_list; d != NULL; d = d->next) {
+		if (d->ctl_list != NULL)
+			ctl_sort(d);
+	}
+}
+
+/*
+ * return the device with the given name, or NULL if it's unknown
+ */
+static struct dev *
+dev_find(char *name)
+{
+	struct dev *d;
+
+	for (d = dev_list; d != NULL; d = d->next) {
+		if (strcmp(d->name, name) == 0)
+			return d;
+	}
+	return NULL;
+}
+
+/*
+ * return the device with the given name, adding it if needed
+ */
+static struct dev *
+dev_get(char *name)
+{
+	struct dev *d, **pd;
+
+	for (pd = &dev_list; (d = *pd) != NULL; pd = &d->next) {
+		if (strcmp(d->name, name) == 0)
+			return d;
+	}
+
+	d = calloc(1, sizeof(struct dev));
+	if (d == NULL) {
+		logx(1, "failed to allocate device: %s", strerror(errno));
+		exit(1);
+	}
+	d->name = strdup(name);
+	if (d->name == NULL) {
+		logx(1, "failed to allocate device: %s", strerror(errno));
+		exit(1);
+	}
+	d->retry_delay = CTL_RETRY_MIN;
+	*pd = d;
+	return d;
+}
+
+/*
+ * send changed values to the server. As ctl_setdirty() is called for
+ * all the key presses queued, only the final value of each control
+ * is sent
+ */
+static void
+ctl_flush(struct dev *d)
+{
+	struct ctl *i, *r, **pi;
+	long long now;
+
+	now = ctl_rate ? mtime() : 0;
+	if (idle_timo && d->ctl_dirty)
+		d->use_time = now ? now : mtime();
+	d->flush_time = 0;
+	pi = &d->ctl_dirty;
+	while ((i = *pi) != NULL) {
+		/*
+		 * with -r, the rate is limited per selector, not per
+		 * entry, so its state is kept in the first entry
+		 */
+		r = i;
+		if (ctl_rate && i->type == SIOCTL_SEL) {
+			while (r->prev != NULL && samegroup(r->prev, r))
+				r = r->prev;
+		}
+
+		/* too early, keep it dirty, the latest value is sent */
+		if (ctl_rate && now < r->send_time) {
+			if (d->flush_time == 0 || r->send_time < d->flush_time)
+				d->flush_time = r->send_time;
+			pi = &i->dirty_next;
+			continue;
+		}
+
+		*pi = i->dirty_next;
+		i->dirty = 0;
+
+		/* only the selected entry of a selector is set */
+		if (i->type == SIOCTL_SEL && i->val == 0)
+			continue;
+		sioctl_setval(d->ctl_hdl, i->addr, i->val);
+		stat_setvals++;
+		if (ctl_rate)
+			r->send_time = now + 1000 / ctl_rate;
+		if (timing) {
+			i->setval_time = ustime();
+			timing_add(TIMING_KEY, i->setval_time - i->key_time);
+		}
+	}
+}
+
+static void
+setval_sel(struct ctl *first, int dir)
+{
+	struct ctl *cur, *next;
+
+	if (dir != 0)
+		return;
+
+	/* find the current entry */
+
+	cur = first;
+	while (cur->val == 0) {
+		cur = nextent(cur);
+		if (cur == NULL) {
+			logx(1, "%d: no current value", first->addr);
+			return;
 		}
 	}
 
 	/* find the next entry */
 
-	next = nextent(cur);
-	if (next == NULL)
-		next = first;
-	if (next == cur) {
-		logx(1, "%d: no next value", first->desc.addr);
+	next = nextent(cur);
+	if (next == NULL)
+		next = first;
+	if (next == cur) {
+		logx(1, "%d: no next value", first->addr);
+		return;
+	}
+
+	logx(2, "%d -> %s", next->addr, atom_name(next->node1));
+
+	cur->val = 0;
+	next->val = 1;
+	ctl_setdirty(next);
+	if (!silent) {
+		beep_pending = 1;
+		beep_tone = TONE_SEL;
+	}
+}
+
+/*
+ * return the logarithmic steps table for the given maxval, creating
+ * it on first use
+ */
+static struct steptab *
+steptab_get(unsigned int maxval)
+{
+	struct steptab *t;
+	double v;
+	int i;
+
+	for (t = steptab_list; t != NULL; t = t->next) {
+		if (t->maxval == maxval)
+			return t;
+	}
+
+	t = malloc(sizeof(struct steptab));
+	if (t == NULL) {
+		logx(1, "failed to allocate steps: %s", strerror(errno));
+		exit(1);
+	}
+	t->maxval = maxval;
+
+	v = maxval;
+	for (i = NSTEP; i > 0; i--) {
+		t->val[i] = v + 0.5;
+		v *= STEP_RATIO;
+	}
+	t->val[0] = 0;
+
+	/* make sure steps are distinct at low levels */
+	for (i = 1; i <= NSTEP; i++) {
+		if (t->val[i] <= t->val[i - 1])
+			t->val[i] = t->val[i - 1] + 1;
+	}
+
+	t->next = steptab_list;
+	steptab_list = t;
+	return t;
+}
+
+/*
+ * return the value nstep logarithmic steps away from val
+ */
+static int
+steptab_move(struct steptab *t, int val, int dir, int nstep)
+{
+	int i;
+
+	if (dir > 0) {
+		for (i = 0; i < NSTEP && t->val[i] <= val; i++)
+			; /* nothing */
+		i += nstep - 1;
+	} else {
+		for (i = NSTEP; i > 0 && t->val[i] >= val; i--)
+			; /* nothing */
+		i -= nstep - 1;
+	}
+	if (i < 0)
+		i = 0;
+	if (i > NSTEP)
+		i = NSTEP;
+	return t->val[i];
+}
+
+static void
+setval_num(struct ctl *i, int dir, int nstep)
+{
+	int val, incr;
+
+	if (i->maxval > 1 && dir != 0) {
+		if (step_log && i->maxval >= NSTEP) {
+			val = steptab_move(steptab_get(i->maxval),
+			    i->val, dir, nstep);
+		} else {
+			incr = ((int)i->maxval + NSTEP - 1) / NSTEP;
+			val = i->val + dir * incr * nstep;
+		}
+		if (val < 0)
+			val = 0;
+		if (val > i->maxval)
+			val = i->maxval;
+		if (val == i->val)
+			return;
+	} else if (i->maxval == 1 && dir == 0) {
+		val = i->val ^ 1;
+	} else
+		return;
+
+	logx(2, "%d -> %d", i->addr, val);
+
+	i->val = val;
+	ctl_setdirty(i);
+	if (!silent) {
+		beep_pending = 1;
+		if (dir == 0)
+			beep_tone = TONE_TOGGLE;
+		else
+			beep_tone = dir > 0 ? TONE_UP : TONE_DOWN;
+	}
+}
+
+/*
+ * set the controls of the preset to their values. Changes are
+ * only marked dirty, so they are all sent by the same ctl_flush()
+ * pass of the main loop, with a single beep
+ */
+static void
+setval_preset(struct key *key)
+{
+	struct target *t;
+	struct dev *d;
+	struct ctl *i, *j, *cur;
+	int n, val, changed;
+
+	changed = 0;
+	for (n = 0; n < key->ntargets; n++) {
+		t = &key->targets[n];
+		d = t->dev ? t->dev : key->dev;
+		if (!d->ctl_hdl && !ctl_open(d) && d->ctl_list == NULL)
+			continue;
+		for (i = d->ctl_list; i != NULL; i = nextctl(i)) {
+			if (i->group != atom_empty ||
+			    i->node0 != t->name || i->func != t->func)
+				continue;
+			if (i->type == SIOCTL_SEL) {
+				cur = NULL;
+				for (j = i; j != NULL; j = nextent(j)) {
+					if (j->node1 == t->ent)
+						cur = j;
+				}
+				if (cur == NULL) {
+					logx(1, "%s: no such entry",
+					    atom_name(t->ent));
+					continue;
+				}
+				if (cur->val)
+					continue;
+				for (j = i; j != NULL; j = nextent(j))
+					j->val = 0;
+				cur->val = 1;
+				ctl_setdirty(cur);
+				changed = 1;
+				continue;
+			}
+			if (!t->isnum) {
+				logx(1, "%s: expected a number",
+				    atom_name(t->ent));
+				continue;
+			}
+			val = t->pct ? (t->val * i->maxval + 50) / 100 : t->val;
+			if (val > i->maxval)
+				val = i->maxval;
+			if (val == i->val)
+				continue;
+			logx(2, "%d -> %d", i->addr, val);
+			i->val = val;
+			ctl_setdirty(i);
+			changed = 1;
+		}
+	}
+	if (changed && !silent) {
+		beep_pending = 1;
+		beep_tone = TONE_SEL;
+	}
+}
+
+/*
+ * change the controls the key acts on
+ */
+static void
+setval(struct key *key, Time time)
+{
+	struct ctl *i;
+	int n, nstep;
+
+	if (key->ntargets > 0) {
+		setval_preset(key);
+		return;
+	}
+
+	/* if the device is gone, act on the snapshot, if any */
+	if (!key->dev->ctl_hdl) {
+		if (!ctl_open(key->dev) && key->nctls == 0)
+			return;
+	}
+
+	nstep = 1;
+	if (step_accel) {
+		if (time - key->last_time >= ACCEL_DELAY)
+			key->repeat = 0;
+		else if (key->repeat < INT_MAX)
+			key->repeat++;
+		key->last_time = time;
+		for (n = key->repeat / ACCEL_COUNT; n > 0; n--) {
+			if (nstep >= ACCEL_MAX)
+				break;
+			nstep <<= 1;
+		}
+		if (nstep > ACCEL_MAX)
+			nstep = ACCEL_MAX;
+	}
+
+	for (n = 0; n < key->nctls; n++) {
+		i = key->ctls[n];
+		if (i->type == SIOCTL_SEL)
+			setval_sel(i, key->dir);
+		else
+			setval_num(i, key->dir, nstep);
+	}
+}
+
+/*
+ * error handler for Xlib functions. Print a meaningful
+ * message for well-known errors and exit.
+ */
+static int
+error_handler(Display *d, XErrorEvent *e)
+{
+	struct key *key;
+
+	if (e->request_code == X_GrabKey && e->error_code == BadAccess) {
+		for (key = key_list; key != NULL; key = key->next) {
+			if (e->serial - key->grab_start <
+			    key->grab_end - key->grab_start)
+				break;
+		}
+		logx(1, "Key \"%s\" already grabbed by another program",
+		    key ? XKeysymToString(key->sym) : "?");
+		if (grab_nofatal) {
+			if (key)
+				key->failed = 1;
+			return 0;
+		}
+		exit(1);
+	}
+
+	return error_handler_xlib(d, e);
+}
+
+#ifdef USE_XCB
+static void
+keymap_free(void)
+{
+	free(keymap);
+	keymap = NULL;
+}
+
+/*
+ * find which modifiers are bound to keys, from the reply to the
+ * modifier mapping request, and free it
+ */
+static void
+keymap_setmods(xcb_get_modifier_mapping_reply_t *mrep)
+{
+	xcb_keycode_t *codes;
+	int i, j;
+
+	if (mrep == NULL) {
+		keymap_mods = 0xff;
+		return;
+	}
+	codes = xcb_get_modifier_mapping_keycodes(mrep);
+	keymap_mods = 0;
+	for (i = 0; i < 8; i++) {
+		for (j = 0; j < mrep->keycodes_per_modifier; j++) {
+			if (codes[i * mrep->keycodes_per_modifier + j]) {
+				keymap_mods |= 1 << i;
+				break;
+			}
+		}
+	}
+	free(mrep);
+	logx(2, "modifiers in use: 0x%x", keymap_mods);
+}
+
+/*
+ * fetch the mapping of all keys and, if mods is set, the modifier
+ * mapping. Both requests are sent before waiting for the replies,
+ * so this costs a single round-trip. Modifiers not bound to any key
+ * can't be set, so there's no need to grab keys for combinations
+ * including them
+ */
+static void
+keymap_fetch(int mods)
+{
+	const xcb_setup_t *setup;
+	xcb_get_keyboard_mapping_cookie_t kcookie;
+	xcb_get_keyboard_mapping_reply_t *krep;
+	xcb_get_modifier_mapping_cookie_t mcookie;
+	xcb_keysym_t *syms;
+	int i, n;
+
+	keymap_free();
+	setup = xcb_get_setup(xcb);
+	keymap_min = setup->min_keycode;
+	keymap_max = setup->max_keycode;
+	kcookie = xcb_get_keyboard_mapping(xcb,
+	    keymap_min, keymap_max - keymap_min + 1);
+	if (mods)
+		mcookie = xcb_get_modifier_mapping(xcb);
+
+	krep = xcb_get_keyboard_mapping_reply(xcb, kcookie, NULL);
+	if (krep == NULL || krep->keysyms_per_keycode <= ShiftMask) {
+		logx(1, "couldn't get keyboard mapping");
+		exit(1);
+	}
+	keymap_width = krep->keysyms_per_keycode;
+	n = xcb_get_keyboard_mapping_keysyms_length(krep);
+	syms = xcb_get_keyboard_mapping_keysyms(krep);
+	keymap = reallocarray(NULL, n, sizeof(KeySym));
+	if (keymap == NULL) {
+		logx(1, "failed to allocate keymap: %s", strerror(errno));
+		exit(1);
+	}
+	for (i = 0; i < n; i++)
+		keymap[i] = syms[i];
+	free(krep);
+
+	if (mods)
+		keymap_setmods(xcb_get_modifier_mapping_reply(xcb, mcookie, NULL));
+}
+
+/*
+ * fetch the modifier mapping only
+ */
+static void
+keymap_fetchmods(void)
+{
+	keymap_setmods(xcb_get_modifier_mapping_reply(xcb,
+	    xcb_get_modifier_mapping(xcb), NULL));
+}
+
+/*
+ * return the first code the keysym is mapped to. Xlib's copy of
+ * the keymap isn't updated as it doesn't see the events, so search
+ * ours in the same order as XKeysymToKeycode()
+ */
+static KeyCode
+keymap_keycode(KeySym sym)
+{
+	int i, j;
+
+	for (j = 0; j < keymap_width; j++) {
+		for (i = keymap_min; i <= keymap_max; i++) {
+			if (keymap[(i - keymap_min) * keymap_width + j] == sym)
+				return i;
+		}
+	}
+	return 0;
+}
+#else
+static void
+keymap_free(void)
+{
+	if (keymap != NULL)
+		XFree(keymap);
+	keymap = NULL;
+}
+
+/*
+ * find which modifiers are bound to keys. Others can't be set, so
+ * there's no need to grab keys for combinations including them
+ */
+static void
+keymap_fetchmods(void)
+{
+	XModifierKeymap *modmap;
+	int i, j;
+
+	modmap = XGetModifierMapping(dpy);
+	if (modmap == NULL) {
+		keymap_mods = 0xff;
+		return;
+	}
+	keymap_mods = 0;
+	for (i = 0; i < 8; i++) {
+		for (j = 0; j < modmap->max_keypermod; j++) {
+			if (modmap->modifiermap[i * modmap->max_keypermod + j]) {
+				keymap_mods |= 1 << i;
+				break;
+			}
+		}
+	}
+	XFreeModifiermap(modmap);
+	logx(2, "modifiers in use: 0x%x", keymap_mods);
+}
+
+/*
+ * fetch the mapping of all keys at once, in a single round-trip,
+ * and the modifier mapping if mods is set
+ */
+static void
+keymap_fetch(int mods)
+{
+	keymap_free();
+	XDisplayKeycodes(dpy, &keymap_min, &keymap_max);
+	keymap = XGetKeyboardMapping(dpy, keymap_min,
+	    keymap_max - keymap_min + 1, &keymap_width);
+	if (keymap == NULL || keymap_width <= ShiftMask) {
+		logx(1, "couldn't get keyboard mapping");
+		exit(1);
+	}
+	if (mods)
+		keymap_fetchmods();
+}
+
+static KeyCode
+keymap_keycode(KeySym sym)
+{
+	return XKeysymToKeycode(dpy, sym);
+}
+#endif
+
+/*
+ * return the code of the key, checking it's in the keymap
+ */
+static KeyCode
+keymap_code(struct key *key)
+{
+	KeyCode code;
+
+	code = keymap_keycode(key->sym);
+	if (code < keymap_min || code > keymap_max) {
+		logx(1, "%s: couldn't get keymap for key",
+		    XKeysymToString(key->sym));
+		exit(1);
+	}
+	return code;
+}
+
+/*
+ * link keys to the keymap and rebuild the keycode-indexed table
+ */
+static void
+keymap_link(void)
+{
+	struct key *key, **p;
+
+	memset(key_tab, 0, sizeof(key_tab));
+	for (key = key_list; key != NULL; key = key->next) {
+		key->map = keymap + (key->code - keymap_min) * keymap_width;
+
+		/* append to the list of keys with the same code */
+		for (p = &key_tab[key->code]; *p != NULL; p = &(*p)->code_next)
+			; /* nothing */
+		key->code_next = NULL;
+		*p = key;
+	}
+}
+
+/*
+ * Grab the key with the given modifiers on all screens.
+ *
+ * With Xlib, errors are reported asynchronously, so record the
+ * serials of the requests to find the key in error_handler(). With
+ * XCB, keep the cookie of each request, checked by grab_sync().
+ */
+#ifdef USE_XCB
+static void
+grab_mod(struct key *key, unsigned int mods)
+{
+	struct grab_req *r;
+	unsigned int scr, nscr;
+
+	nscr = ScreenCount(dpy);
+	for (scr = 0; scr != nscr; scr++) {
+		if (grab_nreqs == grab_maxreqs) {
+			grab_maxreqs = grab_maxreqs ?
+			    2 * grab_maxreqs : 64;
+			r = reallocarray(grab_reqs,
+			    grab_maxreqs, sizeof(struct grab_req));
+			if (r == NULL) {
+				logx(1, "failed to allocate grabs: %s",
+				    strerror(errno));
+				exit(1);
+			}
+			grab_reqs = r;
+		}
+		r = &grab_reqs[grab_nreqs++];
+		r->key = key;
+		r->cookie = xcb_grab_key_checked(xcb, 1,
+		    RootWindow(dpy, scr), mods, key->code,
+		    XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC);
+	}
+}
+
+/*
+ * release the grabs of grab_mod()
+ */
+static void
+ungrab_mod(struct key *key, unsigned int mods)
+{
+	unsigned int scr, nscr;
+
+	nscr = ScreenCount(dpy);
+	for (scr = 0; scr != nscr; scr++)
+		xcb_ungrab_key(xcb, key->code, RootWindow(dpy, scr), mods);
+}
+
+static void
+ungrab_all(void)
+{
+	unsigned int scr, nscr;
+
+	nscr = ScreenCount(dpy);
+	for (scr = 0; scr != nscr; scr++) {
+		xcb_ungrab_key(xcb, XCB_GRAB_ANY,
+		    RootWindow(dpy, scr), XCB_MOD_MASK_ANY);
+	}
+}
+
+/*
+ * wait for the results of the grabs. The first check waits for the
+ * replies of all the requests sent so far, the others don't block
+ */
+static void
+grab_sync(void)
+{
+	xcb_generic_error_t *err;
+	struct key *key;
+	int n;
+
+	for (n = 0; n < grab_nreqs; n++) {
+		err = xcb_request_check(xcb, grab_reqs[n].cookie);
+		if (err == NULL)
+			continue;
+		key = grab_reqs[n].key;
+		if (err->error_code != XCB_ACCESS) {
+			logx(1, "%s: grab failed, error %u",
+			    XKeysymToString(key->sym), err->error_code);
+		} else if (!key->failed) {
+			logx(1, "Key \"%s\" already grabbed by another program",
+			    XKeysymToString(key->sym));
+		}
+		free(err);
+		if (!grab_nofatal)
+			exit(1);
+		key->failed = 1;
+	}
+	grab_nreqs = 0;
+}
+#else
+static void
+grab_mod(struct key *key, unsigned int mods)
+{
+	unsigned int scr, nscr;
+
+	/* requests of the key are sent in a row, extend the range */
+	if (key->grab_end != NextRequest(dpy))
+		key->grab_start = NextRequest(dpy);
+	nscr = ScreenCount(dpy);
+	for (scr = 0; scr != nscr; scr++) {
+		XGrabKey(dpy, key->code, mods,
+		    RootWindow(dpy, scr), 1,
+		    GrabModeAsync, GrabModeAsync);
+	}
+	key->grab_end = NextRequest(dpy);
+}
+
+/*
+ * release the grabs of grab_mod()
+ */
+static void
+ungrab_mod(struct key *key, unsigned int mods)
+{
+	unsigned int scr, nscr;
+
+	nscr = ScreenCount(dpy);
+	for (scr = 0; scr != nscr; scr++)
+		XUngrabKey(dpy, key->code, mods, RootWindow(dpy, scr));
+}
+
+static void
+ungrab_all(void)
+{
+	unsigned int scr, nscr;
+
+	nscr = ScreenCount(dpy);
+	for (scr = 0; scr != nscr; scr++)
+		XUngrabKey(dpy, AnyKey, AnyModifier, RootWindow(dpy, scr));
+}
+
+/*
+ * wait for the grabs to complete, errors are handled by
+ * error_handler()
+ */
+static void
+grab_sync(void)
+{
+	XSync(dpy, False);
+}
+#endif
+
+/*
+ * Return true if the key is grabbed with the given modifiers, while
+ * only the modifiers of the avail mask are bound to keys.
+ *
+ * The key is grabbed for all the modifier combinations whose MODMASK
+ * bits match exactly. This way X sends the events regardless of the
+ * state of the other modifiers: Shift, Caps Lock, Num Lock, Scroll
+ * Lock and Mode switch. Combinations of modifiers not bound to any
+ * key are skipped.
+ */
+static int
+grab_needed(struct key *key, unsigned int mods, unsigned int avail)
+{
+	return (mods & MODMASK) == key->modmask &&
+	    (mods & ~(MODMASK | avail)) == 0;
+}
+
+static void
+grab_key(struct key *key)
+{
+	unsigned int i;
+
+	for (i = 0; i <= 0xff; i++) {
+		if (grab_needed(key, i, keymap_mods))
+			grab_mod(key, i);
+	}
+}
+
+/*
+ * release the grabs of grab_key()
+ */
+static void
+ungrab_key(struct key *key)
+{
+	unsigned int i;
+
+	for (i = 0; i <= 0xff; i++) {
+		if (grab_needed(key, i, keymap_mods))
+			ungrab_mod(key, i);
+	}
+}
+
+/*
+ * register hot-keys
+ */
+static void
+grab_keys(void)
+{
+	struct key *key;
+
+	stat_regrabs++;
+	keymap_fetch(1);
+	for (key = key_list; key != NULL; key = key->next) {
+		key->code = keymap_code(key);
+		grab_key(key);
+	}
+	keymap_link();
+	grab_sync();
+}
+
+/*
+ * update hot-keys after the keyboard was remapped: only keys whose
+ * code changed are ungrabbed and grabbed again, others are just
+ * linked to the new keymap
+ */
+static void
+regrab_keys(void)
+{
+	struct key *key, *k;
+
+	stat_regrabs++;
+	keymap_fetch(0);
+
+	for (key = key_list; key != NULL; key = key->next)
+		key->newcode = keymap_code(key);
+
+	for (key = key_list; key != NULL; key = key->next) {
+		if (key->newcode == key->code)
+			continue;
+
+		/* keep the grab if another key still uses it */
+		for (k = key_list; k != NULL; k = k->next) {
+			if (k->newcode == key->code &&
+			    k->modmask == key->modmask)
+				break;
+		}
+		if (k == NULL)
+			ungrab_key(key);
+	}
+
+	for (key = key_list; key != NULL; key = key->next) {
+		if (key->newcode == key->code)
+			continue;
+		logx(2, "%s: moved from code %u to %u",
+		    XKeysymToString(key->sym), key->code, key->newcode);
+		key->code = key->newcode;
+		grab_key(key);
+	}
+
+	keymap_link();
+	grab_sync();
+}
+
+/*
+ * update hot-keys after the modifiers were remapped: keys are grabbed
+ * or ungrabbed only for the combinations of the modifiers that became
+ * bound or unbound, others keep their grabs
+ */
+static void
+regrab_mods(void)
+{
+	struct key *key;
+	unsigned int i, oldmods;
+
+	oldmods = keymap_mods;
+	keymap_fetchmods();
+	if (keymap_mods == oldmods)
+		return;
+
+	stat_regrabs++;
+	for (key = key_list; key != NULL; key = key->next) {
+		for (i = 0; i <= 0xff; i++) {
+			if (grab_needed(key, i, oldmods) &&
+			    !grab_needed(key, i, keymap_mods))
+				ungrab_mod(key, i);
+		}
+	}
+
+	/* grab after all ungrabs, so requests of each key are in a row */
+	for (key = key_list; key != NULL; key = key->next) {
+		for (i = 0; i <= 0xff; i++) {
+			if (grab_needed(key, i, keymap_mods) &&
+			    !grab_needed(key, i, oldmods))
+				grab_mod(key, i);
+		}
+	}
+	grab_sync();
+}
+
+/*
+ * unregister hot-keys
+ */
+static void
+ungrab_keys(void)
+{
+	keymap_free();
+	memset(key_tab, 0, sizeof(key_tab));
+	ungrab_all();
+}
+
+/*
+ * free a key binding already removed from key_list, releasing its
+ * grabs unless another binding uses them
+ */
+static void
+key_del(struct key *key)
+{
+	struct key *k;
+
+	if (keymap != NULL && key->code != 0) {
+		for (k = key_list; k != NULL; k = k->next) {
+			if (k->code == key->code && k->modmask == key->modmask)
+				break;
+		}
+		if (k == NULL)
+			ungrab_key(key);
+	}
+	if (key->ramping)
+		ramp_count--;
+	free(key->targets);
+	free(key->ctls);
+	free(key);
+}
+
+/*
+ * parse the list of values of a preset, with this format:
+ *
+ *	[device ':'] name '.' func '=' value [',' ...]
+ *
+ * where value is a number, a percentage, or a selector entry. If key
+ * is NULL, only check the syntax. Return 0 on error
+ */
+static int
+preset_parse(char *text, struct key *key)
+{
+	struct target *targets, *t;
+	char *buf, *p, *item, *dev, *name, *func, *val, *end;
+	int n, ok;
+
+	buf = strdup(text);
+	if (buf == NULL) {
+		logx(1, "failed to allocate preset: %s", strerror(errno));
+		exit(1);
+	}
+
+	n = 1;
+	for (p = buf; *p != 0; p++) {
+		if (*p == ',')
+			n++;
+	}
+	targets = reallocarray(NULL, n, sizeof(struct target));
+	if (targets == NULL) {
+		logx(1, "failed to allocate preset: %s", strerror(errno));
+		exit(1);
+	}
+
+	ok = 1;
+	n = 0;
+	p = buf;
+	while ((item = strsep(&p, ",")) != NULL) {
+		val = strchr(item, '=');
+		if (val == NULL) {
+			logx(1, "%s: expected '='", item);
+			ok = 0;
+			break;
+		}
+		*val++ = 0;
+		name = strrchr(item, ':');
+		if (name != NULL) {
+			*name++ = 0;
+			dev = item;
+		} else {
+			name = item;
+			dev = NULL;
+		}
+		func = strchr(name, '.');
+		if (func == NULL || func[1] == 0 || *val == 0) {
+			logx(1, "%s: expected name.func=value", name);
+			ok = 0;
+			break;
+		}
+		*func++ = 0;
+
+		t = &targets[n++];
+		t->dev = dev ? dev_get(dev) : NULL;
+		t->name = atom(name);
+		t->func = atom(func);
+		t->ent = atom(val);
+		t->val = strtol(val, &end, 10);
+		t->pct = (*end == '%');
+		if (t->pct)
+			end++;
+		t->isnum = (end != val && *end == 0 && t->val >= 0);
+	}
+	free(buf);
+
+	if (!ok || key == NULL) {
+		free(targets);
+		return ok;
+	}
+	key->targets = targets;
+	key->ntargets = n;
+	return 1;
+}
+
+/*
+ * add key binding, removing old binding for the same function
+ */
+static struct key *
+add_key(unsigned int modmask, KeySym sym,
+    struct dev *dev, char *name, char *func, int dir)
+{
+	struct key *key, **p;
+	int aname, afunc;
+
+	aname = atom(name);
+	afunc = atom(func);
+
+	/* delete existing bindings for the same function */
+	p = &key_list;
+	while ((key = *p) != NULL) {
+		if (key->dev == dev &&
+		    key->name == aname && key->func == afunc &&
+		    key->dir == dir) {
+			*p = key->next;
+			key_del(key);
+		} else
+			p = &key->next;
+	}
+
+	key = malloc(sizeof(struct key));
+	if (key == NULL) {
+		logx(1, "failed to allocate key: %s", strerror(errno));
+		exit(1);
+	}
+	key->sym = sym;
+	key->modmask = modmask;
+	key->dev = dev;
+	key->name = aname;
+	key->func = afunc;
+	key->dir = dir;
+	key->ctls = NULL;
+	key->nctls = key->maxctls = 0;
+	key->last_time = 0;
+	key->repeat = 0;
+	key->conf = 0;
+	key->fresh = 0;
+	key->failed = 0;
+	key->targets = NULL;
+	key->ntargets = 0;
+	key->ramping = 0;
+	if (*name == 0)
+		preset_parse(func, key);
+
+	key->next = NULL;
+	*p = key;
+	return key;
+}
+
+/*
+ * parse key binding with this format:
+ *
+ *	[mod '+' mod '+' ...] key ':' [device ':'] name '.' func
+ *	    {'+' | '-' | '!'}
+ *
+ * or, for presets, the key followed by the list of values parsed by
+ * preset_parse(). Presets are returned with an empty name and the
+ * list as func
+ */
+static int
+parsebind(char *str, unsigned int *rmodmask, KeySym *rkeysym,
+    char **rdev, char **rname, char **rfunc, int *rdir)
+{
+	char *p, *end, *name, *func, *dev;
+	struct modname *mod;
+	unsigned int modmask;
+	KeySym keysym;
+	int dir;
+
+	name = strchr(str, ':');
+	if (name == NULL) {
+		logx(1, "%s: expected ':'", str);
+		return 0;
+	}
+	*name++ = 0;
+
+	p = str;
+
+	modmask = 0;
+	while (1) {
+		end = strchr(p, '+');
+		if (end == NULL)
+			break;
+		*end = 0;
+
+		mod = modname_tab;
+		while (1) {
+			if (mod->modmask == 0) {
+				logx(1, "%s: bad modifier", p);
+				return 0;
+			}
+			if (strcmp(p, mod->name) == 0) {
+				modmask |= mod->modmask;
+				break;
+			}
+			mod++;
+		}
+
+		p = end + 1;
+	}
+
+	keysym = XStringToKeysym(p);
+	if (keysym == NoSymbol) {
+		logx(1, "%s: unknowm key", p);
+		return 0;
+	}
+
+	if (strchr(name, '=') != NULL) {
+		if (!preset_parse(name, NULL))
+			return 0;
+		*rmodmask = modmask;
+		*rkeysym = keysym;
+		*rdev = NULL;
+		*rname = "";
+		*rfunc = name;
+		*rdir = 0;
+		return 1;
+	}
+
+	dev = NULL;
+	p = strchr(name, ':');
+	if (p != NULL) {
+		*p++ = 0;
+		dev = name;
+		name = p;
+	}
+
+	*rmodmask = modmask;
+	*rkeysym = keysym;
+	*rdev = dev;
+
+	/*
+	 * compat with old versions
+	 */
+	if (strcmp(name, "inc_level") == 0) {
+		*rname = "output";
+		*rfunc = "level";
+		*rdir = 1;
+		return 1;
+	} else if (strcmp(name, "dec_level") == 0) {
+		*rname = "output";
+		*rfunc = "level";
+		*rdir = -1;
+		return 1;
+	} else if (strcmp(name, "cycle_dev") == 0) {
+		*rname = "server";
+		*rfunc = "device";
+		*rdir = 0;
+		return 1;
+	}
+
+	func = strchr(name, '.');
+	if (func == NULL) {
+		logx(1, "%s: expected '.'", name);
+		return 0;
+	}
+	*func++ = 0;
+
+	if ((end = strchr(func, '+')) != NULL) {
+		dir = 1;
+	} else if ((end = strchr(func, '-')) != NULL) {
+		dir = -1;
+	} else if ((end = strchr(func, '!')) != NULL) {
+		dir = 0;
+	} else {
+		logx(1, "%s: expected '+', '-' or '!'", func);
+		return 0;
+	}
+	*end++ = 0;
+
+	if (*end != 0) {
+		logx(1, "%s: junk at end of the argument", end);
+		return 0;
+	}
+
+	*rname = name;
+	*rfunc = func;
+	*rdir = dir;
+	return 1;
+}
+
+/*
+ * parse an integer option argument in the [min:max] range, exit on
+ * error
+ */
+static int
+parsenum(char *str, int min, int max, char *what)
+{
+	char *end;
+	long val;
+
+	errno = 0;
+	val = strtol(str, &end, 10);
+	if (end == str || *end != 0 || errno != 0 || val < min || val > max) {
+		logx(1, "%s: %s must be in the %d..%d range",
+		    str, what, min, max);
+		exit(1);
+	}
+	return val;
+}
+
+/*
+ * parse a key binding of the command line and add it
+ */
+static void
+parsekey(char *str)
+{
+	unsigned int modmask;
+	KeySym keysym;
+	char *dev, *name, *func;
+	int dir;
+
+	if (!parsebind(str, &modmask, &keysym, &dev, &name, &func, &dir))
+		exit(1);
+	add_key(modmask, keysym, dev ? dev_get(dev) : NULL, name, func, dir);
+}
+
+/*
+ * grab the key of a binding added while running. The result is
+ * checked by key_commit(), so several keys cost a single round-trip
+ */
+static void
+key_attach(struct key *key)
+{
+	key->fresh = 1;
+	key->code = keymap_keycode(key->sym);
+	if (key->code < keymap_min || key->code > keymap_max) {
+		logx(1, "%s: couldn't get keymap for key",
+		    XKeysymToString(key->sym));
+		key->code = 0;
+		key->failed = 1;
 		return;
 	}
+	grab_nofatal = 1;
+	grab_key(key);
+}
 
-	logx(2, "%d -> %s", next->desc.addr, next->desc.node1.name);
+/*
+ * wait for the grabs of key_attach(), drop the keys that couldn't be
+ * grabbed and resolve the others. Return the number of dropped keys
+ */
+static int
+key_commit(void)
+{
+	struct key *key, **p;
+	int nfailed;
 
-	cur->val = 0;
-	next->val = 1;
-	sioctl_setval(ctl_hdl, next->desc.addr, 1);
-	if (!silent)
-		beep_pending = 1;
+	grab_sync();
+	grab_nofatal = 0;
+
+	nfailed = 0;
+	p = &key_list;
+	while ((key = *p) != NULL) {
+		if (key->failed) {
+			*p = key->next;
+			key_del(key);
+			nfailed++;
+		} else
+			p = &key->next;
+	}
+	keymap_link();
+
+	for (key = key_list; key != NULL; key = key->next) {
+		if (key->fresh) {
+			key->fresh = 0;
+			if (key->dev->ctl_hdl)
+				key_resolve(key);
+		}
+	}
+	stat_regrabs++;
+	if (trace_file)
+		trace_keys();
+	return nfailed;
+}
+
+/*
+ * add a key binding while running, grabbing its key
+ */
+static int
+key_bind(char *str)
+{
+	unsigned int modmask;
+	KeySym keysym;
+	char *dev, *name, *func;
+	int dir;
+
+	if (!parsebind(str, &modmask, &keysym, &dev, &name, &func, &dir))
+		return 0;
+	key_attach(add_key(modmask, keysym,
+	    dev ? dev_get(dev) : dev_default, name, func, dir));
+	return key_commit() == 0;
+}
+
+/*
+ * remove a key binding while running, ungrabbing its key
+ */
+static int
+key_unbind(char *str)
+{
+	unsigned int modmask;
+	KeySym keysym;
+	char *dev, *name, *func;
+	struct dev *d;
+	struct key *key, **p;
+	int dir, found;
+
+	if (!parsebind(str, &modmask, &keysym, &dev, &name, &func, &dir))
+		return 0;
+
+	/* no key uses a device we don't know */
+	d = dev ? dev_find(dev) : dev_default;
+	if (d == NULL)
+		return 0;
+
+	found = 0;
+	p = &key_list;
+	while ((key = *p) != NULL) {
+		if (key->modmask == modmask && key->sym == keysym &&
+		    key->dev == d && key->dir == dir &&
+		    strcmp(atom_name(key->name), name) == 0 &&
+		    strcmp(atom_name(key->func), func) == 0) {
+			*p = key->next;
+			key_del(key);
+			found = 1;
+		} else
+			p = &key->next;
+	}
+	if (!found)
+		return 0;
+	keymap_link();
+	stat_regrabs++;
+	if (trace_file)
+		trace_keys();
+	return 1;
+}
+
+/*
+ * order bindings by control, then by position in the file
+ */
+static int
+cmpbind(const void *p1, const void *p2)
+{
+	const struct bind *b1 = p1, *b2 = p2;
+	int cmp;
+
+	cmp = strcmp(b1->dev->name, b2->dev->name);
+	if (cmp != 0)
+		return cmp;
+	if (b1->name != b2->name)
+		return b1->name < b2->name ? -1 : 1;
+	if (b1->func != b2->func)
+		return b1->func < b2->func ? -1 : 1;
+	if (b1->dir != b2->dir)
+		return b1->dir < b2->dir ? -1 : 1;
+	if (b1->line != b2->line)
+		return b1->line < b2->line ? -1 : 1;
+	return 0;
+}
+
+/*
+ * return true if both bindings are for the same control
+ */
+static int
+samebind(struct bind *b1, struct bind *b2)
+{
+	return b1->dev == b2->dev && b1->name == b2->name &&
+	    b1->func == b2->func && b1->dir == b2->dir;
+}
+
+/*
+ * parse the configuration file into a sorted table of bindings.
+ * Lines are either bindings in the -b syntax or
+ *
+ *	'device' name
+ *
+ * which selects the device of the bindings that follow and don't
+ * specify one. If a control is bound more than once, the last
+ * binding wins. Return 0 on error, leaving the table unchanged
+ */
+static int
+conf_parse(char *path, int must_exist, struct bind **rtab, int *rcount)
+{
+	FILE *f;
+	char *buf, *line, *end, *devname, *name, *func;
+	size_t bufsz;
+	struct bind *tab, *b;
+	struct dev *dev;
+	int count, size, lineno, i, n, ok;
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		if (errno == ENOENT && !must_exist) {
+			*rtab = NULL;
+			*rcount = 0;
+			return 1;
+		}
+		logx(1, "%s: %s", path, strerror(errno));
+		return 0;
+	}
+
+	buf = NULL;
+	bufsz = 0;
+	tab = NULL;
+	count = size = 0;
+	lineno = 0;
+	dev = dev_default;
+	ok = 1;
+	while (getline(&buf, &bufsz, f) != -1) {
+		lineno++;
+		if ((end = strchr(buf, '#')) != NULL)
+			*end = 0;
+		for (line = buf; *line == ' ' || *line == '\t'; line++)
+			; /* nothing */
+		end = line + strlen(line);
+		while (end > line && (end[-1] == ' ' || end[-1] == '\t' ||
+		    end[-1] == '\n' || end[-1] == '\r'))
+			end--;
+		*end = 0;
+		if (*line == 0)
+			continue;
+
+		if (strncmp(line, "device", 6) == 0 &&
+		    (line[6] == ' ' || line[6] == '\t')) {
+			for (line += 6; *line == ' ' || *line == '\t'; line++)
+				; /* nothing */
+			dev = dev_get(line);
+			continue;
+		}
+
+		if (count == size) {
+			size = size ? 2 * size : 64;
+			b = reallocarray(tab, size, sizeof(struct bind));
+			if (b == NULL) {
+				logx(1, "failed to allocate bindings: %s",
+				    strerror(errno));
+				exit(1);
+			}
+			tab = b;
+		}
+		b = tab + count;
+		if (!parsebind(line, &b->modmask, &b->sym,
+		    &devname, &name, &func, &b->dir)) {
+			logx(1, "%s:%d: bad binding", path, lineno);
+			ok = 0;
+			continue;
+		}
+		b->dev = devname ? dev_get(devname) : dev;
+		b->name = atom(name);
+		b->func = atom(func);
+		b->line = lineno;
+		count++;
+	}
+	if (ferror(f)) {
+		logx(1, "%s: %s", path, strerror(errno));
+		ok = 0;
+	}
+	free(buf);
+	fclose(f);
+
+	if (!ok) {
+		free(tab);
+		return 0;
+	}
+
+	/* sort by control and keep the last binding of each */
+	qsort(tab, count, sizeof(struct bind), cmpbind);
+	n = 0;
+	for (i = 0; i < count; i++) {
+		if (i + 1 < count && samebind(tab + i, tab + i + 1))
+			continue;
+		tab[n++] = tab[i];
+	}
+
+	*rtab = tab;
+	*rcount = n;
+	return 1;
 }
 
+/*
+ * add a key for the given binding, unless the control is bound on
+ * the command line
+ */
 static void
-setval_num(struct ctl *i, int dir)
+conf_add(struct bind *b)
 {
-	int val, incr;
+	struct key *key;
 
-	if (i->desc.maxval > 1 && dir != 0) {
-		incr = ((int)i->desc.maxval + NSTEP - 1) / NSTEP;
-		val = i->val + dir * incr;
-		if (val < 0)
-			val = 0;
-		if (val > i->desc.maxval)
-			val = i->desc.maxval;
-		if (val == i->val)
+	for (key = key_list; key != NULL; key = key->next) {
+		if (!key->conf && key->dev == b->dev &&
+		    key->name == b->name && key->func == b->func &&
+		    key->dir == b->dir)
 			return;
-	} else if (i->desc.maxval == 1 && dir == 0) {
-		val = i->val ^ 1;
+	}
+	key = add_key(b->modmask, b->sym, b->dev,
+	    atom_name(b->name), atom_name(b->func), b->dir);
+	key->conf = 1;
+	if (keymap != NULL)
+		key_attach(key);
+}
+
+/*
+ * remove the key of the given binding
+ */
+static void
+conf_del(struct bind *b)
+{
+	struct key *key, **p;
+
+	for (p = &key_list; (key = *p) != NULL; p = &key->next) {
+		if (key->conf && key->dev == b->dev &&
+		    key->name == b->name && key->func == b->func &&
+		    key->dir == b->dir) {
+			*p = key->next;
+			key_del(key);
+			return;
+		}
+	}
+}
+
+/*
+ * switch to a new table of bindings. Both tables are sorted, so
+ * walk them in parallel and only touch the keys of bindings that
+ * were added, removed or changed
+ */
+static void
+conf_apply(struct bind *tab, int count)
+{
+	struct bind *o, *o_end, *n, *n_end;
+	int cmp, nchanged;
+
+	o = conf_tab;
+	o_end = conf_tab + conf_count;
+	n = tab;
+	n_end = tab + count;
+	nchanged = 0;
+	while (o != o_end || n != n_end) {
+		if (o == o_end)
+			cmp = 1;
+		else if (n == n_end)
+			cmp = -1;
+		else if (samebind(o, n))
+			cmp = 0;
+		else
+			cmp = cmpbind(o, n);
+		if (cmp < 0) {
+			conf_del(o++);
+			nchanged++;
+		} else if (cmp > 0) {
+			conf_add(n++);
+			nchanged++;
+		} else {
+			if (o->modmask != n->modmask || o->sym != n->sym) {
+				conf_add(n);
+				nchanged++;
+			}
+			o++;
+			n++;
+		}
+	}
+
+	free(conf_tab);
+	conf_tab = tab;
+	conf_count = count;
+
+	if (keymap != NULL) {
+		if (nchanged > 0 && key_commit() > 0)
+			logx(1, "%s: some keys couldn't be grabbed", conf_path);
+		logx(1, "%s: %d bindings, %d changed",
+		    conf_path, count, nchanged);
+	}
+}
+
+/*
+ * read the configuration file again, keeping the current bindings
+ * on error
+ */
+static void
+conf_reload(void)
+{
+	struct bind *tab;
+	int count;
+
+	if (!conf_parse(conf_path, conf_required, &tab, &count))
+		return;
+	conf_apply(tab, count);
+}
+
+static void
+conf_sighup(int sig)
+{
+	conf_reload_pending = 1;
+	sig_wakeup();
+}
+
+/*
+ * close the connection to the control socket
+ */
+static void
+client_close(struct client *c)
+{
+	struct client **pc;
+
+	for (pc = &client_list; *pc != c; pc = &(*pc)->next)
+		; /* nothing */
+	*pc = c->next;
+	close(c->fd);
+	free(c);
+	maxfds--;
+}
+
+/*
+ * send a reply line to the client. The socket is non-blocking, so
+ * a client not reading its replies gets disconnected
+ */
+static int __attribute__((format(printf, 2, 3)))
+client_printf(struct client *c, const char *fmt, ...)
+{
+	char line[LOG_LINEMAX];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+	if (len < 0)
+		return 0;
+	if (len >= sizeof(line))
+		len = sizeof(line) - 1;
+	return write(c->fd, line, len) == len;
+}
+
+/*
+ * send the state of devices and bindings
+ */
+static int
+client_dump(struct client *c)
+{
+	struct dev *d;
+	struct ctl *i;
+	struct key *key;
+	char *suffix;
+
+	for (d = dev_list; d != NULL; d = d->next) {
+		if (!client_printf(c, "dev %s %s\n", d->name,
+		    d->ctl_hdl ? "open" : "closed"))
+			return 0;
+		for (i = d->ctl_list; i != NULL; i = i->next) {
+			if (!client_printf(c, "ctl %s %u %s/%s[%d].%s %s = %d\n",
+			    d->name, i->addr, atom_name(i->group),
+			    atom_name(i->node0), i->unit0,
+			    atom_name(i->func), atom_name(i->node1), i->val))
+				return 0;
+		}
+	}
+	for (key = key_list; key != NULL; key = key->next) {
+		suffix = key->dir > 0 ? "+" : (key->dir < 0 ? "-" : "!");
+		if (key->ntargets > 0) {
+			if (!client_printf(c, "key 0x%x %s %s:%s\n",
+			    key->modmask, XKeysymToString(key->sym),
+			    key->dev->name, atom_name(key->func)))
+				return 0;
+			continue;
+		}
+		if (!client_printf(c, "key 0x%x %s %s:%s.%s%s %d\n",
+		    key->modmask, XKeysymToString(key->sym), key->dev->name,
+		    atom_name(key->name), atom_name(key->func), suffix,
+		    key->nctls))
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * execute a command received on the control socket
+ */
+static int
+client_exec(struct client *c, char *line)
+{
+	char *arg;
+
+	arg = strchr(line, ' ');
+	if (arg != NULL)
+		*arg++ = 0;
+
+	if (strcmp(line, "bind") == 0 && arg != NULL) {
+		if (!key_bind(arg))
+			return client_printf(c, "error\n");
+	} else if (strcmp(line, "unbind") == 0 && arg != NULL) {
+		if (!key_unbind(arg))
+			return client_printf(c, "error\n");
+	} else if (strcmp(line, "dump") == 0 && arg == NULL) {
+		if (!client_dump(c))
+			return 0;
+	} else if (strcmp(line, "stats") == 0 && arg == NULL) {
+		if (!client_printf(c, "events %lu\nsetvals %lu\n"
+		    "beeps %lu\nregrabs %lu\nwakeups %lu\n",
+		    stat_events, stat_setvals, stat_beeps, stat_regrabs,
+		    stat_wakeups))
+			return 0;
 	} else
+		return client_printf(c, "unknown command\n");
+	return client_printf(c, "ok\n");
+}
+
+/*
+ * read commands from the control socket, one per line
+ */
+static void
+client_read(struct client *c)
+{
+	char *line, *end;
+	ssize_t n;
+
+	n = read(c->fd, c->buf + c->used, CLIENT_BUFSZ - c->used);
+	if (n <= 0) {
+		if (n < 0 && errno == EAGAIN)
+			return;
+		client_close(c);
 		return;
+	}
+	c->used += n;
+
+	line = c->buf;
+	while ((end = memchr(line, '\n', c->used - (line - c->buf)))) {
+		*end = 0;
+		if (end > line && end[-1] == '\r')
+			end[-1] = 0;
+		if (!client_exec(c, line)) {
+			client_close(c);
+			return;
+		}
+		line = end + 1;
+	}
+	c->used -= line - c->buf;
+	if (c->used == CLIENT_BUFSZ) {
+		logx(1, "control socket: line too long");
+		client_close(c);
+		return;
+	}
+	memmove(c->buf, line, c->used);
+}
 
-	logx(2, "%d -> %d", i->desc.addr, val);
+/*
+ * accept a new connection to the control socket
+ */
+static void
+sock_accept(void)
+{
+	struct client *c;
+	int fd;
 
-	i->val = val;
-	sioctl_setval(ctl_hdl, i->desc.addr, val);
-	if (!silent)
-		beep_pending = 1;
+	fd = accept(sock_fd, NULL, NULL);
+	if (fd < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			logx(1, "%s: accept: %s", sock_path, strerror(errno));
+		return;
+	}
+	if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+		close(fd);
+		return;
+	}
+	c = malloc(sizeof(struct client));
+	if (c == NULL) {
+		logx(1, "failed to allocate client: %s", strerror(errno));
+		close(fd);
+		return;
+	}
+	c->fd = fd;
+	c->pfd = -1;
+	c->used = 0;
+	c->next = client_list;
+	client_list = c;
+	maxfds++;
+}
+
+/*
+ * return the given path made absolute, as daemon() changes the
+ * current directory to /, exit on error
+ */
+static char *
+abspath(char *path)
+{
+	char cwd[PATH_MAX], *p;
+	size_t len;
+
+	if (path[0] == '/')
+		return path;
+	if (getcwd(cwd, sizeof(cwd)) == NULL) {
+		logx(1, "getcwd: %s", strerror(errno));
+		exit(1);
+	}
+	len = strlen(cwd) + strlen(path) + 2;
+	p = malloc(len);
+	if (p == NULL) {
+		logx(1, "failed to allocate path: %s", strerror(errno));
+		exit(1);
+	}
+	snprintf(p, len, "%s/%s", cwd, path);
+	return p;
 }
 
 /*
- * change the control
+ * create the control socket
  */
 static void
-setval(char *name, char *func, int dir)
+sock_listen(void)
 {
-	struct ctl *i;
+	struct sockaddr_un sa;
 
-	if (!ctl_hdl) {
-		if (!ctl_open())
-			return;
+	if (strlen(sock_path) >= sizeof(sa.sun_path)) {
+		logx(1, "%s: path too long", sock_path);
+		exit(1);
 	}
-
-	i = ctl_list;
-	while (1) {
-		if (i == NULL)
-			return;
-		if (i->desc.group[0] == 0 &&
-		    strcmp(i->desc.node0.name, name) == 0 &&
-		    strcmp(i->desc.func, func) == 0) {
-			if (i->desc.type == SIOCTL_SEL)
-				setval_sel(i, dir);
-			else
-				setval_num(i, dir);
-		}
-		i = nextctl(i);
+	sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock_fd < 0) {
+		logx(1, "socket: %s", strerror(errno));
+		exit(1);
 	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	memcpy(sa.sun_path, sock_path, strlen(sock_path) + 1);
+	unlink(sock_path);
+	if (bind(sock_fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 ||
+	    listen(sock_fd, 1) < 0 ||
+	    fcntl(sock_fd, F_SETFL, O_NONBLOCK) < 0) {
+		logx(1, "%s: %s", sock_path, strerror(errno));
+		exit(1);
+	}
+	maxfds++;
 }
 
 /*
- * error handler for Xlib functions. Print a meaningful
- * message for well-known errors and exit.
+ * close the control socket and all its connections
  */
-static int
-error_handler(Display *d, XErrorEvent *e)
+static void
+sock_close(void)
 {
-	if (e->request_code == X_GrabKey && e->error_code == BadAccess) {
-		logx(1, "Key \"%s\" already grabbed by another program",
-		    XKeysymToString(error_keysym));
-		exit(1);
-	}
-
-	return error_handler_xlib(d, e);
+	while (client_list != NULL)
+		client_close(client_list);
+	close(sock_fd);
+	unlink(sock_path);
+	sock_fd = -1;
+	maxfds--;
 }
 
 /*
- * register hot-keys
+ * handle keyboard and modifier mapping changes
  */
 static void
-grab_keys(void)
+x_mapping(int request)
 {
-	struct key *key;
-	unsigned int i, scr, nscr;
-	int nret;
-
-	for (key = key_list; key != NULL; key = key->next) {
-
-		key->code = XKeysymToKeycode(dpy, key->sym);
-		key->map = XGetKeyboardMapping(dpy, key->code, 1, &nret);
-		if (nret <= ShiftMask) {
-			logx(1, "%s: couldn't get keymap for key",
-			    XKeysymToString(key->sym));
-			exit(1);
-		}
-
-		/*
-		 * Grab the key for all the modifier combinations
-		 * whose MODMASK bits match exactly. This way
-		 * X sends the events regardless of the state
-		 * of the other modifiers: Shift, Caps Lock,
-		 * Num Lock, Scroll Lock and Mode switch.
-		 */
-		error_keysym = key->sym;
-		nscr = ScreenCount(dpy);
-		for (i = 0; i <= 0xff; i++) {
-			if ((i & MODMASK) != key->modmask)
-				continue;
-			for (scr = 0; scr != nscr; scr++) {
-				XGrabKey(dpy, key->code, i,
-				    RootWindow(dpy, scr), 1,
-				    GrabModeAsync, GrabModeAsync);
-			}
-		}
-		XSync(dpy, False);
+	if (request == MappingModifier) {
+		logx(1, "modifiers remapped");
+		regrab_mods();
+	} else if (request == MappingKeyboard) {
+		logx(1, "keyboard remapped");
+		regrab_keys();
+	}
+	if (trace_file) {
+		if (request == MappingModifier || request == MappingKeyboard)
+			trace_putkeymap();
+		trace_write(TRACE_MAPPING, request, 0, 0);
 	}
 }
 
 /*
- * unregister hot-keys
+ * change the controls of the keys matching the key press. In ramp
+ * mode, keys that increase or decrease levels start a ramp, which
+ * continues until the key is released; auto-repeat is ignored
  */
 static void
-ungrab_keys(void)
+x_keypress(unsigned int code, unsigned int state, Time time)
 {
 	struct key *key;
-	unsigned int scr, nscr;
 
-	for (key = key_list; key != NULL; key = key->next) {
-		XFree(key->map);
+	if (trace_file)
+		trace_write(TRACE_PRESS, code & 0xff, state, time);
+	if (timing)
+		key_time = ustime();
+	for (key = key_tab[code & 0xff]; key != NULL; key = key->code_next) {
+		if (key->map[state & ShiftMask] != key->sym ||
+		    key->modmask != (state & MODMASK))
+			continue;
+		if (ramp_rate == 0 || key->dir == 0 || key->ntargets > 0) {
+			setval(key, time);
+			continue;
+		}
+		if (key->ramping)
+			continue;
+		setval(key, time);
+		key->ramping = 1;
+		key->ramp_time = mtime() + 1000 / ramp_rate;
+		ramp_count++;
 	}
-
-	nscr = ScreenCount(dpy);
-	for (scr = 0; scr != nscr; scr++)
-		XUngrabKey(dpy, AnyKey, AnyModifier, RootWindow(dpy, scr));
 }
 
 /*
- * add key binding, removing old binding for the same function
+ * stop the ramps of the released key, regardless of the modifiers
+ * as they may be released first
  */
 static void
-add_key(unsigned int modmask, KeySym sym, char *name, char *func, int dir)
+x_keyrelease(unsigned int code)
 {
-	struct key *key, **p;
-
-	/* delete existing bindings for the same function */
-	p = &key_list;
-	while ((key = *p) != NULL) {
-		if (strcmp(key->name, name) == 0 &&
-		    strcmp(key->func, func) == 0 && key->dir == dir) {
-			*p = key->next;
-			free(key);
-		} else
-			p = &key->next;
-	}
+	struct key *key;
 
-	key = malloc(sizeof(struct key));
-	if (key == NULL) {
-		logx(1, "failed to allocate key: %s", strerror(errno));
-		exit(1);
+	if (trace_file)
+		trace_write(TRACE_RELEASE, code & 0xff, 0, 0);
+	for (key = key_tab[code & 0xff]; key != NULL; key = key->code_next) {
+		if (key->ramping) {
+			key->ramping = 0;
+			ramp_count--;
+		}
 	}
-	key->sym = sym;
-	key->modmask = modmask;
-	key->name = name;
-	key->func = func;
-	key->dir = dir;
-
-	key->next = NULL;
-	*p = key;
 }
 
 /*
- * parse key binding with this format:
- *
- *	[mod '+' mod '+' ...] key ':' name '.' func {'+' | '-' | '!'}
+ * advance the ramps whose next step is due. Steps are given X times
+ * one period apart, so -A accelerates ramps as well
  */
 static void
-parsekey(char *str)
+ramp_run(void)
 {
-	char *p, *end, *name, *func;
-	struct modname *mod;
-	unsigned int modmask;
-	KeySym keysym;
-	int dir;
-
-	name = strchr(str, ':');
-	if (name == NULL) {
-		logx(1, "%s: expected ':'", str);
-		exit(1);
-	}
-	*name++ = 0;
-
-	p = str;
-
-	modmask = 0;
-	while (1) {
-		end = strchr(p, '+');
-		if (end == NULL)
-			break;
-		*end = 0;
-
-		mod = modname_tab;
-		while (1) {
-			if (mod->modmask == 0) {
-				logx(1, "%s: bad modifier", p);
-				exit(1);
-			}
-			if (strcmp(p, mod->name) == 0) {
-				modmask |= mod->modmask;
-				break;
-			}
-			mod++;
-		}
-
-		p = end + 1;
-	}
-
-	keysym = XStringToKeysym(p);
-	if (keysym == NoSymbol) {
-		logx(1, "%s: unknowm key", p);
-		exit(1);
-	}
-
-	/*
-	 * compat with old versions
-	 */
-	if (strcmp(name, "inc_level") == 0) {
-		add_key(modmask, keysym, "output", "level", 1);
-		return;
-	} else if (strcmp(name, "dec_level") == 0) {
-		add_key(modmask, keysym, "output", "level", -1);
-		return;
-	} else if (strcmp(name, "cycle_dev") == 0) {
-		add_key(modmask, keysym, "server", "device", 0);
-		return;
-	}
-
-	func = strchr(name, '.');
-	if (func == NULL) {
-		fprintf(stderr, "%s: expected '.'", name);
-		exit(1);
-	}
-	*func++ = 0;
-
-	if ((end = strchr(func, '+')) != NULL) {
-		dir = 1;
-	} else if ((end = strchr(func, '-')) != NULL) {
-		dir = -1;
-	} else if ((end = strchr(func, '!')) != NULL) {
-		dir = 0;
-	} else {
-		fprintf(stderr, "%s: expected '+', '-' or '!'", end);
-		exit(1);
-	}
-	*end++ = 0;
+	struct key *key;
+	long long now;
+	int period;
 
-	if (*end != 0) {
-		logx(1, "%s: junk at end of the argument", end);
-		exit(1);
+	period = 1000 / ramp_rate;
+	now = mtime();
+	for (key = key_list; key != NULL; key = key->next) {
+		if (!key->ramping || now < key->ramp_time)
+			continue;
+		if (timing)
+			key_time = ustime();
+		setval(key, key->last_time + period);
+		key->ramp_time += period;
+		if (key->ramp_time < now)
+			key->ramp_time = now + period;
 	}
-
-	add_key(modmask, keysym, name, func, dir);
 }
 
 int
 main(int argc, char **argv)
 {
 	int scr;
+#ifdef USE_XCB
+	xcb_generic_event_t *xcb_ev;
+	xcb_generic_error_t *xcb_err;
+	xcb_key_press_event_t *xcb_kev;
+	int type;
+#else
 	XEvent xev;
-	int c, nfds, ctl_nfds, beep_nfds;
+#endif
+	int c, nfds, beep_nfds, log_pfd, sig_pfd, revents, timo;
+	long long now;
 	int background;
-	struct pollfd pfds[MAXFDS];
 	struct key *key;
+	struct dev *d;
+	struct steptab *t;
+	struct sigaction sa;
+	struct client *cl, *cl_next;
+	struct bind *tab;
+	char *home;
+	size_t len;
+	int count;
+	Bool xkb_detectable;
 	int xkb, xkb_ev_base, xkb_auto_controls, xkb_auto_values;
 
-	dev_name = SIO_DEVANY;
 	verbose = 1;
+	atexit(log_drain);
+	atom_empty = atom("");
 	background = 0;
 
-	while ((c = getopt(argc, argv, "ab:Df:m:sv")) != -1) {
+	while ((c = getopt(argc, argv, "Aab:C:cDF:f:Hi:lm:R:r:S:sTtvw:")) != -1) {
 		switch (c) {
+		case 'A':
+			step_accel = 1;
+			break;
 		case 'a':
 			audible_bell = 1;
 			break;
 		case 'b':
 			parsekey(optarg);
 			break;
+		case 'C':
+			cache_path = optarg;
+			break;
+		case 'c':
+			ctl_eager = 1;
+			break;
 		case 'D':
 			background = 1;
 			break;
+		case 'F':
+			conf_path = optarg;
+			conf_required = 1;
+			break;
 		case 'f':
-			dev_name = optarg;
+			d = dev_get(optarg);
+			if (dev_default == NULL)
+				dev_default = d;
+			break;
+		case 'H':
+			beep_hot = 1;
+			break;
+		case 'i':
+			idle_timo = parsenum(optarg, 1, 86400,
+			    "idle timeout") * 1000;
+			break;
+		case 'l':
+			step_log = 1;
+			break;
+		case 'R':
+			ramp_rate = parsenum(optarg, 1, 1000, "ramp rate");
+			break;
+		case 'r':
+			ctl_rate = parsenum(optarg, 1, 1000, "rate");
+			break;
+		case 'S':
+			sock_path = optarg;
 			break;
 		case 's':
 			silent = 1;
 			break;
+		case 'T':
+			beep_threaded = 1;
+			break;
+		case 't':
+			timing = 1;
+			break;
 		case 'v':
 			verbose++;
 			break;
+		case 'w':
+			trace_path = optarg;
+			break;
 		default:
 			goto bad_usage;
 		}
@@ -714,20 +4107,58 @@ main(int argc, char **argv)
 	if (argc > 0) {
 	bad_usage:
 		fputs("usage: sndiokeys "
-		    "[-aDsv] "
-		    "[-b [mod+...]key:control[+|-|!] "
-		    "[-f device]\n",
+		    "[-AacDHlsTtv] "
+		    "[-b [mod+...]key:[device:]control[+|-|!] [-C file] "
+		    "[-F file] [-f device] [-i timeout] [-R rate] [-r rate] "
+		    "[-S socket] [-w file]\n",
 		    stderr);
 		exit(1);
 	}
 
+	/*
+	 * bindings without device use the first -f device, which
+	 * also plays the bell
+	 */
+	if (dev_default == NULL)
+		dev_default = dev_get(SIO_DEVANY);
+	for (key = key_list; key != NULL; key = key->next) {
+		if (key->dev == NULL)
+			key->dev = dev_default;
+	}
+	dev_name = dev_default->name;
+
+	if (conf_path == NULL && (home = getenv("HOME")) != NULL) {
+		len = strlen(home) + strlen(CONF_NAME) + 2;
+		conf_path = malloc(len);
+		if (conf_path == NULL) {
+			logx(1, "failed to allocate path: %s", strerror(errno));
+			exit(1);
+		}
+		snprintf(conf_path, len, "%s/%s", home, CONF_NAME);
+	}
+	if (conf_path != NULL) {
+		if (!conf_parse(conf_path, conf_required, &tab, &count))
+			exit(1);
+		conf_apply(tab, count);
+	}
+
 	if (key_list == NULL) {
-		add_key(ControlMask | Mod1Mask, XK_plus, "output", "level", 1);
-		add_key(ControlMask | Mod1Mask, XK_minus, "output", "level", -1);
-		add_key(ControlMask | Mod1Mask, XK_0, "output", "mute", 0);
-		add_key(ControlMask | Mod1Mask, XK_Tab, "server", "device", 0);
+		add_key(ControlMask | Mod1Mask, XK_plus,
+		    dev_default, "output", "level", 1);
+		add_key(ControlMask | Mod1Mask, XK_minus,
+		    dev_default, "output", "level", -1);
+		add_key(ControlMask | Mod1Mask, XK_0,
+		    dev_default, "output", "mute", 0);
+		add_key(ControlMask | Mod1Mask, XK_Tab,
+		    dev_default, "server", "device", 0);
 	}
 
+	if (cache_path)
+		cache_load();
+
+	if (trace_path)
+		trace_open();
+
 	error_handler_xlib = XSetErrorHandler(error_handler);
 
 	dpy = XOpenDisplay(NULL);
@@ -735,6 +4166,10 @@ main(int argc, char **argv)
 		logx(1, "Couldn't open display");
 		exit(1);
 	}
+#ifdef USE_XCB
+	xcb = XGetXCBConnection(dpy);
+	XSetEventQueueOwner(dpy, XCBOwnsEventQueue);
+#endif
 	maxfds++;
 
 	xkb = 0;
@@ -753,44 +4188,146 @@ main(int argc, char **argv)
 			logx(1, "Audible bell not suppored by the X server");
 	}
 
+	/*
+	 * in ramp mode, key releases stop ramps. Without detectable
+	 * auto-repeat, X would send a release before each repeat
+	 */
+	if (ramp_rate && !XkbSetDetectableAutoRepeat(dpy, True, &xkb_detectable)) {
+		logx(1, "Detectable auto-repeat not supported, ramps disabled");
+		ramp_rate = 0;
+	}
+
 	/* mask non-key events for each screan */
 	for (scr = 0; scr != ScreenCount(dpy); scr++)
 		XSelectInput(dpy, RootWindow(dpy, scr), KeyPress);
 
 	grab_keys();
+	if (trace_file)
+		trace_keys();
+
+	if (sock_path)
+		sock_listen();
+
+	if (conf_path != NULL) {
+		sig_init();
+		sa.sa_handler = conf_sighup;
+		sa.sa_flags = 0;
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGHUP, &sa, NULL);
+	}
+
+	if (timing) {
+		sig_init();
+		sa.sa_handler = timing_sigusr1;
+		sa.sa_flags = 0;
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGUSR1, &sa, NULL);
+	}
 
 	if (background) {
+		/*
+		 * the socket is removed at exit, the configuration is
+		 * reloaded on SIGHUP and the snapshot is saved, after
+		 * daemon() changed the directory
+		 */
+		if (sock_path)
+			sock_path = abspath(sock_path);
+		if (conf_path != NULL)
+			conf_path = abspath(conf_path);
+		if (cache_path)
+			cache_path = abspath(cache_path);
 		verbose = 0;
+		log_drain();
 		if (daemon(0, 0) < 0) {
 			logx(1, "failed to daemonize: %s", strerror(errno));
 			exit(1);
 		}
 	}
 
+	/* the bell is considered used at startup, for -H */
+	beep_use_time = mtime();
+
+	/* threads don't survive daemon(), so start it after */
+	if (beep_threaded)
+		beep_thread_start();
+
 	while (1) {
+		if (timing_dump_pending) {
+			timing_dump();
+			timing_dump_pending = 0;
+		}
+		if (conf_reload_pending) {
+			conf_reload_pending = 0;
+			conf_reload();
+		}
+#ifdef USE_XCB
+		while ((xcb_ev = xcb_poll_for_event(xcb)) != NULL) {
+			stat_events++;
+			type = xcb_ev->response_type & 0x7f;
+			if (type == 0) {
+				xcb_err = (xcb_generic_error_t *)xcb_ev;
+				logx(1, "x11: error %u, request %u",
+				    xcb_err->error_code, xcb_err->major_code);
+			} else if (type == XCB_MAPPING_NOTIFY) {
+				x_mapping(((xcb_mapping_notify_event_t *)
+				    xcb_ev)->request);
+			} else if (type == XCB_KEY_PRESS) {
+				xcb_kev = (xcb_key_press_event_t *)xcb_ev;
+				x_keypress(xcb_kev->detail, xcb_kev->state,
+				    xcb_kev->time);
+			} else if (type == XCB_KEY_RELEASE) {
+				x_keyrelease(((xcb_key_release_event_t *)
+				    xcb_ev)->detail);
+			} else if (xkb && type == xkb_ev_base &&
+			    ((uint8_t *)xcb_ev)[1] == XkbBellNotify) {
+				beep_pending = 1;
+				beep_tone = TONE_BELL;
+			}
+			free(xcb_ev);
+		}
+		if (xcb_connection_has_error(xcb)) {
+			logx(1, "x11: connection lost");
+			break;
+		}
+#else
 		while (XPending(dpy)) {
 			XNextEvent(dpy, &xev);
+			stat_events++;
 			if (xev.type == MappingNotify) {
-				if (xev.xmapping.request != MappingKeyboard)
-					continue;
-				logx(1, "keyboard remapped");
-				ungrab_keys();
-				grab_keys();
+				XRefreshKeyboardMapping(&xev.xmapping);
+				x_mapping(xev.xmapping.request);
 				continue;
 			}
 			if (xkb && xev.type == xkb_ev_base &&
 			    ((XkbEvent *)&xev)->any.xkb_type == XkbBellNotify) {
 				beep_pending = 1;
+				beep_tone = TONE_BELL;
 				continue;
 			}
-			if (xev.type != KeyPress)
+			if (xev.type == KeyRelease) {
+				x_keyrelease(xev.xkey.keycode);
 				continue;
-			for (key = key_list; key != NULL; key = key->next) {
-				if (xev.xkey.keycode == key->code &&
-				    key->map[xev.xkey.state & ShiftMask] == key->sym &&
-				    key->modmask == (xev.xkey.state & MODMASK))
-					setval(key->name, key->func, key->dir);
 			}
+			if (xev.type != KeyPress)
+				continue;
+			x_keypress(xev.xkey.keycode, xev.xkey.state,
+			    xev.xkey.time);
+		}
+#endif
+
+		if (trace_file)
+			trace_loop();
+
+		if (ramp_count > 0)
+			ramp_run();
+
+		/*
+		 * keyboard auto-repeat may change controls multiple times,
+		 * send the final values only
+		 */
+		for (d = dev_list; d != NULL; d = d->next) {
+			if (d->ctl_hdl)
+				ctl_flush(d);
 		}
 
 		/*
@@ -798,62 +4335,234 @@ main(int argc, char **argv)
 		 * play it only once
 		 */
 		if (beep_pending) {
-			beep_play();
+			if (timing) {
+				now = ustime();
+				beep_request(beep_tone);
+				timing_add(TIMING_BEEP, ustime() - now);
+			} else
+				beep_request(beep_tone);
 			beep_pending = 0;
 		}
 
-		nfds = 0;
-		if (ctl_hdl) {
-			ctl_nfds = sioctl_pollfd(ctl_hdl, pfds + nfds, 0);
-			nfds += ctl_nfds;
+		timo = -1;
+		if (ramp_count > 0) {
+			now = mtime();
+			for (key = key_list; key != NULL; key = key->next) {
+				if (key->ramping)
+					timo_set(&timo, key->ramp_time - now);
+			}
+		}
+		for (d = dev_list; d != NULL; d = d->next) {
+			if (d->ctl_hdl && d->flush_time)
+				timo_set(&timo, d->flush_time - mtime());
+		}
+		/*
+		 * in hot mode, keep the bell device open, retrying
+		 * periodically if it's gone
+		 */
+		if (!beep_threaded && beep_hot && (!silent || audible_bell) &&
+		    beep_hdl == NULL && !beep_isidle()) {
+			if (!beep_open())
+				timo_set(&timo, BELL_RETRY);
+		}
+		if (!beep_threaded)
+			beep_idle(&timo);
+
+		/*
+		 * with -i, close the control devices not used for a
+		 * while; the next key press reopens them
+		 */
+		for (d = dev_list; idle_timo && !ctl_eager && d != NULL;
+		     d = d->next) {
+			if (!d->ctl_hdl || d->ctl_dirty)
+				continue;
+			now = mtime();
+			if (now - d->use_time >= idle_timo) {
+				logx(2, "%s: idle, closed", d->name);
+				ctl_close(d);
+			} else
+				timo_set(&timo, d->use_time + idle_timo - now);
 		}
-		if (beep_hdl) {
-			beep_nfds = sio_pollfd(beep_hdl, pfds + nfds, 0);
+
+		/*
+		 * in eager mode, keep the control devices connected, so
+		 * the descriptors are already known on the first key
+		 * press. Retry with exponential backoff if one is gone.
+		 */
+		for (d = dev_list; ctl_eager && d != NULL; d = d->next) {
+			if (d->ctl_hdl)
+				continue;
+			now = mtime();
+			if (now >= d->retry_time) {
+				if (ctl_open(d))
+					d->retry_delay = CTL_RETRY_MIN;
+				else {
+					d->retry_time = now + d->retry_delay;
+					d->retry_delay *= 2;
+					if (d->retry_delay > CTL_RETRY_MAX)
+						d->retry_delay = CTL_RETRY_MAX;
+				}
+			}
+			if (d->ctl_hdl == NULL)
+				timo_set(&timo, d->retry_time - now);
+		}
+
+		pfds_grow();
+		nfds = 1;
+		for (d = dev_list; d != NULL; d = d->next) {
+			if (d->ctl_hdl) {
+				d->ctl_nfds = sioctl_pollfd(d->ctl_hdl,
+				    pfds + nfds, 0);
+				nfds += d->ctl_nfds;
+			}
+		}
+		/*
+		 * once all samples are written, wait for them to be
+		 * played without asking for POLLOUT, which would spin;
+		 * sndio still polls for the position changes
+		 */
+		if (!beep_threaded && beep_hdl) {
+			beep_nfds = sio_pollfd(beep_hdl, pfds + nfds,
+			    beep_running && beep_wpos < beep_end ?
+			    POLLOUT : 0);
 			nfds += beep_nfds;
 		}
-		pfds[nfds].fd = ConnectionNumber(dpy);
-		pfds[nfds].events = POLLIN;
-		nfds++;
+		sock_pfd = -1;
+		if (sock_fd >= 0) {
+			pfds[nfds].fd = sock_fd;
+			pfds[nfds].events = POLLIN;
+			sock_pfd = nfds++;
+		}
+		for (cl = client_list; cl != NULL; cl = cl->next) {
+			pfds[nfds].fd = cl->fd;
+			pfds[nfds].events = POLLIN;
+			cl->pfd = nfds++;
+		}
+		log_pfd = -1;
+		if (log_used > 0) {
+			pfds[nfds].fd = STDERR_FILENO;
+			pfds[nfds].events = POLLOUT;
+			log_pfd = nfds++;
+		}
+		sig_pfd = -1;
+		if (sig_fds[0] >= 0) {
+			pfds[nfds].fd = sig_fds[0];
+			pfds[nfds].events = POLLIN;
+			sig_pfd = nfds++;
+		}
 
-		while (poll(pfds, nfds, -1) < 0 && errno == EINTR)
-			; /* nothing */
+		/*
+		 * requests queued with xcb_*() calls, like the ungrabs of
+		 * an unbind, are in XCB's own buffer, which XFlush()
+		 * doesn't write if Xlib's buffer is empty
+		 */
+#ifdef USE_XCB
+		XFlush(dpy);
+		xcb_flush(xcb);
+#endif
+		if (trace_file)
+			trace_flush();
+		if (poll(pfds, nfds, timo) < 0) {
+			stat_wakeups++;
+			if (errno != EINTR) {
+				logx(1, "poll: %s", strerror(errno));
+				exit(1);
+			}
+			continue;
+		}
+		stat_wakeups++;
 
-		nfds = 0;
-		if (ctl_hdl) {
-			if (sioctl_revents(ctl_hdl, pfds + nfds) & POLLHUP) {
-				logx(1, "sndio: ctl hup");
-				ctl_close();
+		if (pfds[0].revents & POLLHUP) {
+			logx(1, "x11: hup");
+			break;
+		}
+
+		nfds = 1;
+		for (d = dev_list; d != NULL; d = d->next) {
+			if (d->ctl_hdl) {
+				if (sioctl_revents(d->ctl_hdl,
+				    pfds + nfds) & POLLHUP) {
+					logx(1, "%s: ctl hup", d->name);
+					ctl_close(d);
+				}
+				nfds += d->ctl_nfds;
 			}
-			nfds += ctl_nfds;
 		}
-		if (beep_hdl) {
-			if (sio_revents(beep_hdl, pfds + nfds) & POLLHUP) {
+		if (!beep_threaded && beep_hdl) {
+			revents = sio_revents(beep_hdl, pfds + nfds);
+			if (revents & POLLHUP) {
 				logx(1, "sndio: beep hup");
 				beep_close();
+			} else if (beep_running) {
+				if (timing) {
+					now = ustime();
+					beep_write();
+					timing_add(TIMING_BEEP, ustime() - now);
+				} else
+					beep_write();
 			}
 			nfds += beep_nfds;
 		}
-		if (pfds[nfds].revents & POLLHUP) {
-			logx(1, "x11: hup");
-			break;
+		for (cl = client_list; cl != NULL; cl = cl_next) {
+			cl_next = cl->next;
+			if (cl->pfd >= 0 && pfds[cl->pfd].revents)
+				client_read(cl);
 		}
-		nfds++;
+		if (sock_pfd >= 0 && (pfds[sock_pfd].revents & POLLIN))
+			sock_accept();
+		if (log_pfd >= 0 && (pfds[log_pfd].revents &
+		    (POLLOUT | POLLHUP | POLLERR | POLLNVAL)))
+			log_flush(1);
+		if (sig_pfd >= 0 && (pfds[sig_pfd].revents & POLLIN))
+			sig_drain();
 	}
 
+	if (sock_fd >= 0)
+		sock_close();
+
 	ungrab_keys();
 	XCloseDisplay(dpy);
 	maxfds--;
+	free(pfds);
 
-	if (ctl_hdl)
-		ctl_close();
+	if (timing)
+		timing_dump();
 
-	if (beep_hdl)
+	if (cache_path)
+		cache_save();
+
+	if (trace_file)
+		trace_close();
+	free(trace_buf);
+
+	/* the feedback thread uses dev_name, stop it first */
+	if (beep_threaded)
+		beep_thread_stop();
+	else if (beep_hdl)
 		beep_close();
 
+	while ((d = dev_list) != NULL) {
+		if (d->ctl_hdl)
+			ctl_close(d);
+		ctl_clear(d);
+		dev_list = d->next;
+		free(d->name);
+		free(d);
+	}
+
 	while ((key = key_list) != NULL) {
 		key_list = key_list->next;
+		free(key->targets);
+		free(key->ctls);
 		free(key);
 	}
 
+	atom_done();
+
+	while ((t = steptab_list) != NULL) {
+		steptab_list = t->next;
+		free(t);
+	}
+
 	return 0;
 }